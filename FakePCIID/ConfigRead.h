@@ -0,0 +1,78 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef ConfigRead_h
+#define ConfigRead_h
+
+// Config read helpers shared by the kext and the host tests in tools/, so
+// they use only <stdint.h>.
+
+#include <stdint.h>
+
+// The platform aligns config reads (as with CF8/CFC): a read of width
+// bytes at offset returns the width bytes at offset & ~(width - 1).
+static inline uint8_t configReadAlign(uint8_t offset, unsigned width)
+{
+    return offset & ~(width - 1);
+}
+
+// The header dwords that FakeDirectConfigReads reads from ECAM: those that
+// do not change while the function is up.
+enum
+{
+    kDirectReadDwords = 1 << (0x00 >> 2) |  // vendor/device ID
+                        1 << (0x08 >> 2) |  // revision/class code
+                        1 << (0x2C >> 2) |  // subsystem IDs
+                        1 << (0x34 >> 2),   // capabilities pointer
+};
+
+// Read width bytes at offset from a function's memory-mapped (ECAM) config
+// space.  Only the header dwords set in dwords (bit n: offset 4 * n) are
+// read; false for the others, or if the function returns all ones (not
+// responding), so the caller takes the normal path.
+static inline bool ecamConfigRead(const volatile uint32_t* window, uint32_t dwords, uint8_t offset, unsigned width, uint32_t& result)
+{
+    offset = configReadAlign(offset, width);
+    if (offset >= 64 || !(dwords & (1 << (offset >> 2))))
+        return false;
+    uint32_t value = window[offset >> 2];
+    if (0xFFFFFFFF == value)
+        return false;
+    result = value >> (8 * (offset & 3));
+    return true;
+}
+
+// Replace the bytes of value, a read of sizeof(T) bytes at offset, that are
+// overridden: bit n of mask set means config byte n reads as bytes[n].  The
+// overrides cover the 64 byte config header only.
+template <typename T>
+static inline T overlayConfigRead(T value, uint8_t offset, const uint8_t* bytes, uint64_t mask)
+{
+    uint8_t first = configReadAlign(offset, sizeof(T));
+    if (first >= 64)
+        return value;
+    uint32_t bits = (uint32_t)(mask >> first) & ((1 << sizeof(T)) - 1);
+    for (unsigned i = 0; bits; i++, bits >>= 1)
+    {
+        if (bits & 1)
+            value = (value & ~((T)0xFF << (8 * i))) | ((T)bytes[first + i] << (8 * i));
+    }
+    return value;
+}
+
+#endif
@@ -27,6 +27,117 @@ extern kmod_info_t kmod_info;
 
 OSDefineMetaClassAndStructors(FakePCIID, IOService);
 
+FakePCIID* volatile FakePCIID::sHooks[FakePCIID::kMaxHooks];
+FakePCIID::OverrideSlot FakePCIID::sOverrideSlots[FakePCIID::kOverrideSlots];
+FakePCIID::InFlightCounters FakePCIID::sInFlight[kPerCPUMaxCPUs];
+volatile UInt32 FakePCIID::sEpoch;
+volatile UInt32 FakePCIID::sQuiescing;
+
+FakePCIID* FakePCIID::getHook(const IOPCIDevice* device)
+{
+    for (int i = 0; i < kMaxHooks; i++)
+    {
+        FakePCIID* hook = sHooks[i];
+        if (hook && hook->mProvider == device)
+            return hook;
+    }
+    return NULL;
+}
+
+bool FakePCIID::registerHook()
+{
+    int i;
+    for (i = 0; i < kMaxHooks; i++)
+    {
+        if (OSCompareAndSwapPtr(NULL, this, (void* volatile*)&sHooks[i]))
+            break;
+    }
+    if (i == kMaxHooks)
+    {
+        AlwaysLog("too many hooked devices (max %d)\n", kMaxHooks);
+        return false;
+    }
+
+    // claim a slot for this function's overrides; the hook pointer is set
+    // after the key, and lookups ignore the slot until it is
+    mOverrideKey = overrideKey(mProvider->space);
+    for (UInt32 slot = overrideSlot(mOverrideKey);; slot = (slot + 1) & (kOverrideSlots - 1))
+    {
+        UInt32 key = sOverrideSlots[slot].key;
+        if ((key == kOverrideSlotEmpty || key == kOverrideSlotDeleted) &&
+            OSCompareAndSwap(key, mOverrideKey, &sOverrideSlots[slot].key))
+        {
+            sOverrideSlots[slot].hook = this;
+            return true;
+        }
+    }
+}
+
+void FakePCIID::unregisterHook()
+{
+    UInt32 slot = overrideSlot(mOverrideKey);
+    for (int probe = 0; probe < kOverrideSlots; probe++, slot = (slot + 1) & (kOverrideSlots - 1))
+    {
+        if (sOverrideSlots[slot].hook == this)
+        {
+            sOverrideSlots[slot].hook = NULL;
+            __sync_synchronize();
+            sOverrideSlots[slot].key = kOverrideSlotDeleted;
+            break;
+        }
+        if (sOverrideSlots[slot].key == kOverrideSlotEmpty)
+            break;
+    }
+
+    for (int i = 0; i < kMaxHooks; i++)
+    {
+        if (OSCompareAndSwapPtr(this, NULL, (void* volatile*)&sHooks[i]))
+            return;
+    }
+}
+
+void FakePCIID::drainInFlight(UInt32 parity)
+{
+    for (int ms = 1;; ms++)
+    {
+        // exits first: any exit counted here had its entry before, so it is counted too
+        UInt32 entered = 0, exited = 0;
+        for (int cpu = 0; cpu < kPerCPUMaxCPUs; cpu++)
+            exited += sInFlight[cpu].exited[parity];
+        __sync_synchronize();
+        for (int cpu = 0; cpu < kPerCPUMaxCPUs; cpu++)
+            entered += sInFlight[cpu].entered[parity];
+        if (entered == exited)
+            break;
+        if (0 == ms % 1000)
+            AlwaysLog("waiting for %u hooked call(s) to return\n", entered - exited);
+        IOSleep(1);
+    }
+}
+
+void FakePCIID::waitForQuiescence()
+{
+    // one waiter at a time, so the parity being drained is not flipped back under it
+    while (!OSCompareAndSwap(0, 1, &sQuiescing))
+        IOSleep(1);
+
+    // Two grace periods, as SRCU does.  A call whose count is seen unchanged
+    // by its epoch re-read (see InFlight) is counted against that epoch's
+    // parity before the next flip, so the drain that follows the flip sees
+    // it.  A call that read the epoch before the first flip but counted
+    // itself only after the first drain sampled the old parity sees the flip
+    // on its re-read and moves to the new parity, which the second drain
+    // waits for.
+    for (int pass = 0; pass < 2; pass++)
+    {
+        UInt32 parity = sEpoch & 1;
+        OSIncrementAtomic(&sEpoch);     // new calls count against the other parity
+        drainInFlight(parity);
+    }
+
+    sQuiescing = 0;
+}
+
 void FakePCIID::mergeFakeProperties(IOService* provider, const char *name, bool force)
 {
     if (OSDictionary *providerDict = (OSDictionary*)getProperty(name))
@@ -48,10 +159,148 @@ void FakePCIID::mergeFakeProperties(IOService* provider, const char *name, bool
     }
 }
 
+void FakePCIID::mergeProperty(IOService* provider, const char* name, const void* bytes, unsigned length, bool force)
+{
+    // same rule as mergeFakeProperties: only overwrite existing properties when force is true
+    if (force || !provider->getProperty(name))
+    {
+        if (OSData* data = OSData::withBytes(bytes, length))
+        {
+            provider->setProperty(name, data);
+            data->release();
+        }
+    }
+}
+
+static const OverrideBlobRecord* findOverrideRecord(OSData* blob, OSNumber* index, UInt32 deviceInfo)
+{
+    const UInt8* bytes = static_cast<const UInt8*>(blob->getBytesNoCopy());
+    unsigned length = blob->getLength();
+    const OverrideBlobHeader* header = reinterpret_cast<const OverrideBlobHeader*>(bytes);
+
+    // injector_compiler validated the contents, but never trust offsets read from a plist
+    if (length < sizeof(*header) || header->magic != kOverrideBlobMagic || header->version != kOverrideBlobVersion ||
+        header->headerSize < sizeof(*header) || header->totalSize != length)
+        return NULL;
+    if (header->recordsOffset + (UInt64)header->recordCount * sizeof(OverrideBlobRecord) > length ||
+        header->idsOffset + (UInt64)header->idCount * sizeof(OverrideBlobID) > length ||
+        header->idRefsOffset + (UInt64)header->idRefCount * sizeof(UInt16) > length ||
+        header->rulesOffset + (UInt64)header->ruleCount * sizeof(OverrideBlobWriteRule) > length)
+        return NULL;
+    if (!index || index->unsigned32BitValue() >= header->recordCount)
+        return NULL;
+
+    const OverrideBlobRecord* record = reinterpret_cast<const OverrideBlobRecord*>(bytes + header->recordsOffset) + index->unsigned32BitValue();
+    if (record->idRefFirst + record->idRefCount > header->idRefCount || record->ruleFirst + record->ruleCount > header->ruleCount)
+        return NULL;
+
+    // the record must list the device we were matched against (unless matched by class/name)
+    if (record->idRefCount)
+    {
+        const UInt16* idRefs = reinterpret_cast<const UInt16*>(bytes + header->idRefsOffset) + record->idRefFirst;
+        const OverrideBlobID* ids = reinterpret_cast<const OverrideBlobID*>(bytes + header->idsOffset);
+        int i;
+        for (i = 0; i < record->idRefCount; i++)
+        {
+            if (idRefs[i] < header->idCount && (deviceInfo & ids[idRefs[i]].mask) == ids[idRefs[i]].id)
+                break;
+        }
+        if (i == record->idRefCount)
+            return NULL;
+    }
+    return record;
+}
+
+bool FakePCIID::applyOverrideBlob(IOPCIDevice* provider)
+{
+    OSData* blob = OSDynamicCast(OSData, getProperty("FakeOverrides"));
+    if (!blob)
+        return false;
+
+    UInt32 deviceInfo = provider->configRead32(kIOPCIConfigVendorID);
+    const OverrideBlobRecord* record = findOverrideRecord(blob, OSDynamicCast(OSNumber, getProperty("FakeOverridesRecord")), deviceInfo);
+    if (!record)
+    {
+        // the compiler removed the compiled keys from FakeProperties, so only the rest apply
+        AlwaysLog("[%04x:%04x] FakeOverrides invalid or does not match, using what is left of FakeProperties\n", deviceInfo & 0xFFFF, deviceInfo >> 16);
+        return false;
+    }
+
+    // overlay fields go straight into mOverrides; a FakeProperties (not
+    // -Forced) field still gives way to an RM, property already on the provider
+    bzero(mOverrides.bytes, sizeof(mOverrides.bytes));
+    mOverrides.mask = 0;
+    for (unsigned i = 0; i < kOverrideFieldCount; i++)
+    {
+        const OverrideField& field = kOverrideFields[i];
+        UInt64 bits = ((1ULL << field.size) - 1) << field.offset;
+        if ((record->overlayMask & bits) != bits ||
+            ((record->forcedMask & bits) != bits && provider->getProperty(field.name)))
+        {
+            loadOverride(field);
+            continue;
+        }
+        memcpy(&mOverrides.bytes[field.offset], &record->overlay[field.offset], field.size);
+        mOverrides.mask |= bits;
+    }
+
+    const UInt8* bytes = static_cast<const UInt8*>(blob->getBytesNoCopy());
+    const OverrideBlobHeader* header = reinterpret_cast<const OverrideBlobHeader*>(bytes);
+    const OverrideBlobWriteRule* rules = reinterpret_cast<const OverrideBlobWriteRule*>(bytes + header->rulesOffset);
+    for (int i = 0; i < record->ruleCount; i++)
+        applyWriteRule(provider, rules[record->ruleFirst + i]);
+
+    // the compiler leaves only the properties it does not know in FakeProperties
+    if (record->flags & kOverrideRecordPassThrough)
+    {
+        mergeFakeProperties(provider, "FakeProperties", false);
+        mergeFakeProperties(provider, "FakeProperties-Forced", true);
+    }
+
+    return true;
+}
+
+void FakePCIID::applyWriteRule(IOService* provider, const OverrideBlobWriteRule& rule)
+{
+    AlwaysLog("FakeOverrides write rule for 0x%02x not supported by %s\n", rule.offset, getMetaClass()->getClassName());
+}
+
+const FakePCIID::OverrideField FakePCIID::kOverrideFields[kOverrideFieldCount] =
+{
+    { kIOPCIConfigVendorID, 2, "RM,vendor-id", "vendor-id" },
+    { kIOPCIConfigDeviceID, 2, "RM,device-id", "device-id" },
+    { kIOPCIConfigSubSystemVendorID, 2, "RM,subsystem-vendor-id", "subsystem-vendor-id" },
+    { kIOPCIConfigSubSystemID, 2, "RM,subsystem-id", "subsystem-id" },
+    { kIOPCIConfigRevisionID, 1, "RM,revision-id", "revision-id" },
+};
+
+void FakePCIID::loadOverride(const OverrideField& field)
+{
+    int value = PCIDeviceStub::getIntegerProperty(mProvider, field.name, field.alternateName);
+    if (-1 == value)
+        return;
+    for (unsigned i = 0; i < field.size; i++)
+    {
+        mOverrides.bytes[field.offset + i] = value >> (8 * i);
+        mOverrides.mask |= 1ULL << (field.offset + i);
+    }
+}
+
+void FakePCIID::loadOverrides()
+{
+    // resolved once here, so the stub does no property lookups per access
+    bzero(mOverrides.bytes, sizeof(mOverrides.bytes));
+    mOverrides.mask = 0;
+    for (unsigned i = 0; i < kOverrideFieldCount; i++)
+        loadOverride(kOverrideFields[i]);
+}
+
 bool FakePCIID::hookProvider(IOService *provider)
 {
     if (mDeviceVtable)
         return true;  // already hooked
+    if (mProbeWindowClosed)
+        return true;  // unhooked for good after the probe window
 
     IOPCIDevice *device = OSDynamicCast(IOPCIDevice, provider);
     if (!device)
@@ -60,17 +309,38 @@ bool FakePCIID::hookProvider(IOService *provider)
         return false;
     }
 
-    // merge FakeProperties into the provider (only properties that do not exist)
-    mergeFakeProperties(provider, "FakeProperties", false);
-    mergeFakeProperties(provider, "FakeProperties-Forced", true);
-
     // hook provider IOPCIDevice vtable on attach/start
     mProvider = device;
     device->retain();
 
+    // apply compiled FakeOverrides if the injector has them, otherwise
+    // merge FakeProperties into the provider (only properties that do not
+    // exist) and resolve the overrides from its properties
+    if (!applyOverrideBlob(device))
+    {
+        mergeFakeProperties(provider, "FakeProperties", false);
+        mergeFakeProperties(provider, "FakeProperties-Forced", true);
+        loadOverrides();
+    }
+    initClients();
+
+    if (!registerHook())
+    {
+        mProvider = NULL;
+        device->release();
+        return false;
+    }
+    initProfile();
+#ifdef DEBUG
+    initFaults();
+#endif
+    initDirectReads();
+
     mDeviceVtable = getVTable(device);
     setVTable(device, mStubVtable);
 
+    initProbeWindow();
+
     return true;
 }
 
@@ -83,10 +353,397 @@ void FakePCIID::unhookProvider()
     setVTable(mProvider, mDeviceVtable);
     mDeviceVtable = NULL;
 
+    unregisterHook();
+
+    // calls that entered the stub before the vtable was restored may still be
+    // running; wait for them, so the caller can free our state or unload
+    waitForQuiescence();
+
     mProvider->release();
     mProvider = NULL;
 }
 
+void FakePCIID::initProbeWindow()
+{
+    // FakeUnhookAfter: once this client class has started on the provider, the
+    // IDs have served their purpose, so restore the provider's own vtable
+    OSString* className = OSDynamicCast(OSString, getProperty("FakeUnhookAfter"));
+    if (!className || mProbeWindowNotifier)
+        return;
+
+    // matched is delivered on the provider after each matching pass, once the
+    // start() of every driver matched in that pass has returned
+    OSDictionary* matching = registryEntryIDMatching(mProvider->getRegistryEntryID());
+    if (matching)
+    {
+        mProbeWindowNotifier = addMatchingNotification(gIOMatchedNotification, matching,
+            OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &FakePCIID::providerMatched), this);
+        // the notifier holds its own reference to the matching dictionary
+        matching->release();
+    }
+    if (!mProbeWindowNotifier)
+        AlwaysLog("unable to watch for %s, staying hooked\n", className->getCStringNoCopy());
+}
+
+void FakePCIID::freeProbeWindow()
+{
+    // remove waits for a handler in progress, so no unhook can race with stop/free
+    if (mProbeWindowNotifier)
+    {
+        mProbeWindowNotifier->remove();
+        mProbeWindowNotifier = NULL;
+    }
+}
+
+bool FakePCIID::providerMatched(void* refCon, IOService* newService, IONotifier* notifier)
+{
+    OSString* className = OSDynamicCast(OSString, getProperty("FakeUnhookAfter"));
+    if (mProbeWindowClosed || !className || newService != mProvider)
+        return true;
+
+    bool started = false;
+    if (OSIterator* iter = newService->getClientIterator())
+    {
+        while (IOService* client = OSDynamicCast(IOService, iter->getNextObject()))
+        {
+            if (client->metaCast(className->getCStringNoCopy()) && !client->isInactive())
+            {
+                started = true;
+                break;
+            }
+        }
+        iter->release();
+    }
+    if (!started)
+        return true;
+
+    UInt32 deviceInfo = mProvider->configRead32(kIOPCIConfigVendorID);
+    AlwaysLog("[%04x:%04x] %s started, unhooking\n", deviceInfo & 0xFFFF, deviceInfo >> 16, className->getCStringNoCopy());
+
+    // unhookProvider waits for calls still inside PCIDeviceStub
+    mProbeWindowClosed = true;
+    unhookProvider();
+    return true;
+}
+
+void FakePCIID::initProfile()
+{
+    // RM,profile-rate: sample 1 in N hooked config accesses (missing or 0 disables)
+    int rate = PCIDeviceStub::getIntegerProperty(mProvider, "RM,profile-rate", NULL);
+    if (rate <= 0 || mProfileRate)
+        return;
+
+    for (int i = 0; i < kMaxProfileClients; i++)
+        mProfileTags[i] = kFreeSlot;
+    if (!mProfileCounters.init())
+        return;
+    if (!mProfileClients.init())
+    {
+        AlwaysLog("unable to build kext table, profiling disabled\n");
+        mProfileClients.free();
+        mProfileCounters.free();
+        return;
+    }
+    watchKexts();
+    mProfileRate = rate;
+}
+
+void FakePCIID::freeProfile()
+{
+    if (!mProfileRate)
+        return;
+
+    mProfileRate = 0;
+    mProfileClients.free();
+    mProfileCounters.free();
+}
+
+void FakePCIID::initClients()
+{
+    // FakeClients: bundle IDs of the kexts that see the overrides; everyone else
+    // (power management, inventory tools, ...) sees the real IDs
+    OSArray* names = OSDynamicCast(OSArray, getProperty("FakeClients"));
+    if (!names || mOverrides.clients)
+        return;
+
+    if (!mClients.init(names))
+    {
+        AlwaysLog("unable to build kext table, FakeClients ignored\n");
+        mClients.free();
+        return;
+    }
+    watchKexts();
+    mOverrides.clients = &mClients;
+}
+
+void FakePCIID::freeClients()
+{
+    if (!mOverrides.clients)
+        return;
+
+    mOverrides.clients = NULL;
+    mClients.free();
+}
+
+void FakePCIID::watchKexts()
+{
+    // client kexts usually load after we hook, so refresh the tables as drivers are published
+    if (mKextNotifier)
+        return;
+    OSDictionary* matching = serviceMatching("IOService");
+    if (!matching)
+        return;
+    mKextNotifier = addMatchingNotification(gIOPublishNotification, matching,
+        OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &FakePCIID::kextLoaded), this);
+    // the notifier holds its own reference to the matching dictionary
+    matching->release();
+}
+
+void FakePCIID::unwatchKexts()
+{
+    if (mKextNotifier)
+    {
+        mKextNotifier->remove();
+        mKextNotifier = NULL;
+    }
+}
+
+bool FakePCIID::kextLoaded(void* refCon, IOService* newService, IONotifier* notifier)
+{
+    updateKextTables();
+    return true;
+}
+
+void FakePCIID::updateKextTables()
+{
+    if (mProfileRate)
+        mProfileClients.update();
+    if (mOverrides.clients)
+        mClients.update();
+}
+
+#ifdef DEBUG
+void FakePCIID::initFaults()
+{
+    // RM,fault-percent: 1..100 percent of matching reads are affected (missing or 0 disables)
+    int percent = PCIDeviceStub::getIntegerProperty(mProvider, "RM,fault-percent", NULL);
+    if (percent <= 0 || mFaultPercent)
+        return;
+
+    // RM,fault-offset-first/-last: offset range (default whole header)
+    int first = PCIDeviceStub::getIntegerProperty(mProvider, "RM,fault-offset-first", NULL);
+    int last = PCIDeviceStub::getIntegerProperty(mProvider, "RM,fault-offset-last", NULL);
+    // RM,fault-widths: bit 0/1/2 = 1/2/4 byte reads (default all)
+    int widths = PCIDeviceStub::getIntegerProperty(mProvider, "RM,fault-widths", NULL);
+    // RM,fault-delay: busy wait in microseconds before the read returns
+    int delay = PCIDeviceStub::getIntegerProperty(mProvider, "RM,fault-delay", NULL);
+    // RM,fault-absent: non-zero to return all ones, as if the device were gone
+    int absent = PCIDeviceStub::getIntegerProperty(mProvider, "RM,fault-absent", NULL);
+
+    if (!mFaultCounters.init())
+        return;
+
+    mFaultFirst = first < 0 ? 0 : first;
+    mFaultLast = last < 0 ? 0xFF : last;
+    mFaultWidths = widths < 0 ? 1|2|4 : widths & (1|2|4);
+    mFaultDelay = delay < 0 ? 0 : delay;
+    mFaultAbsent = absent > 0;
+    mFaultPercent = percent > 100 ? 100 : percent;
+
+    UInt32 deviceInfo = mProvider->configRead32(kIOPCIConfigVendorID);
+    AlwaysLog("[%04x:%04x] injecting faults: %u%% of reads at 0x%02x-0x%02x, delay %uus%s\n",
+              deviceInfo & 0xFFFF, deviceInfo >> 16, mFaultPercent, mFaultFirst, mFaultLast,
+              mFaultDelay, mFaultAbsent ? ", all ones" : "");
+}
+
+void FakePCIID::freeFaults()
+{
+    mFaultPercent = 0;
+    mFaultCounters.free();
+}
+#endif
+
+// allocation entry of the ACPI MCFG table
+struct MCFGAllocation
+{
+    UInt64 base;
+    UInt16 segment;
+    UInt8 startBus;
+    UInt8 endBus;
+    UInt32 reserved;
+} __attribute__((packed));
+
+#define kMCFGAllocationsOffset  44  // ACPI table header + 8 reserved bytes
+#define kECAMFunctionSize       4096
+
+IOPhysicalAddress FakePCIID::findECAMWindow(IOPCIAddressSpace space)
+{
+    // MCFG as published by the ACPI platform expert
+    IOService* platform = getPlatform();
+    OSDictionary* tables = platform ? OSDynamicCast(OSDictionary, platform->getProperty("ACPI Tables")) : NULL;
+    OSData* mcfg = tables ? OSDynamicCast(OSData, tables->getObject("MCFG")) : NULL;
+    if (!mcfg)
+        return 0;
+
+    const UInt8* bytes = static_cast<const UInt8*>(mcfg->getBytesNoCopy());
+    for (unsigned pos = kMCFGAllocationsOffset; pos + sizeof(MCFGAllocation) <= mcfg->getLength(); pos += sizeof(MCFGAllocation))
+    {
+        const MCFGAllocation* entry = reinterpret_cast<const MCFGAllocation*>(bytes + pos);
+        // IOPCIAddressSpace has no segment, so only segment 0 is supported
+        if (entry->segment || space.s.busNum < entry->startBus || space.s.busNum > entry->endBus)
+            continue;
+        // base is the address of bus 0, even if startBus is not 0
+        return entry->base + ((UInt64)space.s.busNum << 20) +
+               (space.s.deviceNum << 15) + (space.s.functionNum << 12);
+    }
+    return 0;
+}
+
+void FakePCIID::initDirectReads()
+{
+    // FakeDirectConfigReads: read stable header registers straight from the
+    // function's ECAM window instead of through IOPCIFamily
+    OSBoolean* enable = OSDynamicCast(OSBoolean, getProperty("FakeDirectConfigReads"));
+    if (!enable || !enable->isTrue() || mConfigMap)
+        return;
+
+    // not hooked yet, so this is the real value
+    UInt32 deviceInfo = mProvider->configRead32(kIOPCIConfigVendorID);
+
+    IOPhysicalAddress physical = findECAMWindow(mProvider->space);
+    if (!physical)
+    {
+        AlwaysLog("[%04x:%04x] no ECAM window, direct config reads disabled\n", deviceInfo & 0xFFFF, deviceInfo >> 16);
+        return;
+    }
+    IOMemoryDescriptor* desc = IOMemoryDescriptor::withPhysicalAddress(physical, kECAMFunctionSize, kIODirectionIn);
+    if (desc)
+    {
+        mConfigMap = desc->map(kIOMapInhibitCache | kIOMapReadOnly);
+        desc->release();
+    }
+    if (!mConfigMap)
+    {
+        AlwaysLog("[%04x:%04x] unable to map ECAM window, direct config reads disabled\n", deviceInfo & 0xFFFF, deviceInfo >> 16);
+        return;
+    }
+
+    // sanity check the mapping against IOPCIFamily before trusting it
+    volatile UInt32* window = (volatile UInt32*)mConfigMap->getVirtualAddress();
+    if (window[kIOPCIConfigVendorID >> 2] != deviceInfo)
+    {
+        AlwaysLog("[%04x:%04x] ECAM window mismatch (0x%08x), direct config reads disabled\n",
+                  deviceInfo & 0xFFFF, deviceInfo >> 16, window[kIOPCIConfigVendorID >> 2]);
+        mConfigMap->release();
+        mConfigMap = NULL;
+        return;
+    }
+    mConfigSpace = mProvider->space.bits;
+    mConfigWindow = window;
+}
+
+void FakePCIID::freeDirectReads()
+{
+    mConfigWindow = NULL;
+    if (mConfigMap)
+    {
+        mConfigMap->release();
+        mConfigMap = NULL;
+    }
+}
+
+void FakePCIID::profileEnd(UInt64 start, const void* caller, const void* callerCaller, bool write)
+{
+    SInt64 elapsed = mach_absolute_time() - start;
+    UInt32 loadTag = mProfileClients.lookupClient(caller, callerCaller);
+
+    for (int i = 0; i < kMaxProfileClients; i++)
+    {
+        if (mProfileTags[i] != loadTag)
+        {
+            OSCompareAndSwap(kFreeSlot, loadTag, &mProfileTags[i]);
+            if (mProfileTags[i] != loadTag)
+                continue;
+        }
+        ProfileCounters& counters = mProfileCounters.local();
+        OSIncrementAtomic(write ? &counters.writes[i] : &counters.reads[i]);
+        OSAddAtomic64(elapsed, &counters.time[i]);
+        return;
+    }
+    // more than kMaxProfileClients distinct clients: sample is dropped
+}
+
+bool FakePCIID::serializeProperties(OSSerialize* s) const
+{
+    // publish the current profile whenever the registry is read
+    if (mProfileRate)
+    {
+        if (OSDictionary* dict = OSDictionary::withCapacity(kMaxProfileClients))
+        {
+            for (int i = 0; i < kMaxProfileClients; i++)
+            {
+                if (mProfileTags[i] == kFreeSlot)
+                    continue;
+
+                char name[64];
+                if (!mProfileClients.copyName(mProfileTags[i], name, sizeof(name)))
+                    snprintf(name, sizeof(name), "unknown");
+
+                UInt32 reads = 0, writes = 0;
+                UInt64 time = 0;
+                for (int cpu = 0; cpu < PerCPU<ProfileCounters>::kMaxCPUs; cpu++)
+                {
+                    const ProfileCounters& counters = mProfileCounters[cpu];
+                    reads += counters.reads[i];
+                    writes += counters.writes[i];
+                    time += counters.time[i];
+                }
+                UInt64 ns;
+                absolutetime_to_nanoseconds(time, &ns);
+                if (OSDictionary* entry = OSDictionary::withCapacity(3))
+                {
+                    OSNumber* num;
+                    if ((num = OSNumber::withNumber(reads, 32)))
+                        { entry->setObject("Reads", num); num->release(); }
+                    if ((num = OSNumber::withNumber(writes, 32)))
+                        { entry->setObject("Writes", num); num->release(); }
+                    if ((num = OSNumber::withNumber(ns, 64)))
+                        { entry->setObject("TimeNS", num); num->release(); }
+                    dict->setObject(name, entry);
+                    entry->release();
+                }
+            }
+            const_cast<FakePCIID*>(this)->setProperty("RM,Profile", dict);
+            const_cast<FakePCIID*>(this)->setProperty("RM,ProfileRate", mProfileRate, 32);
+            dict->release();
+        }
+    }
+
+#ifdef DEBUG
+    if (mFaultPercent)
+    {
+        UInt32 delayed = 0, absent = 0;
+        for (int cpu = 0; cpu < PerCPU<FaultCounters>::kMaxCPUs; cpu++)
+        {
+            delayed += mFaultCounters[cpu].delayed;
+            absent += mFaultCounters[cpu].absent;
+        }
+        if (OSDictionary* dict = OSDictionary::withCapacity(2))
+        {
+            OSNumber* num;
+            if ((num = OSNumber::withNumber(delayed, 32)))
+                { dict->setObject("Delayed", num); num->release(); }
+            if ((num = OSNumber::withNumber(absent, 32)))
+                { dict->setObject("Absent", num); num->release(); }
+            const_cast<FakePCIID*>(this)->setProperty("RM,Faults", dict);
+            dict->release();
+        }
+    }
+#endif
+
+    return super::serializeProperties(s);
+}
+
 bool FakePCIID::init(OSDictionary *propTable)
 {
     DebugLog("FakePCIID::init() %p\n", this);
@@ -118,6 +775,18 @@ bool FakePCIID::init(OSDictionary *propTable)
 
     mDeviceVtable = NULL;
     mProvider = NULL;
+    mOverrideKey = kOverrideSlotEmpty;
+    mProfileRate = 0;
+    mKextNotifier = NULL;
+    mOverrides.clients = NULL;
+    mProbeWindowNotifier = NULL;
+    mProbeWindowClosed = false;
+#ifdef DEBUG
+    mFaultPercent = 0;
+#endif
+    mConfigMap = NULL;
+    mConfigWindow = NULL;
+    mConfigSpace = 0;
     
     return true;
 }
@@ -161,6 +830,7 @@ void FakePCIID::stop(IOService *provider)
 {
     DebugLog("FakePCIID::stop() %p\n", this);
 
+    freeProbeWindow();
     unhookProvider();
 
     super::stop(provider);
@@ -170,7 +840,15 @@ void FakePCIID::free()
 {
     DebugLog("FakePCIID::free() %p\n", this);
 
+    freeProbeWindow();
     unhookProvider();
+    unwatchKexts();
+    freeProfile();
+    freeClients();
+#ifdef DEBUG
+    freeFaults();
+#endif
+    freeDirectReads();
 
     super::free();
 }
@@ -23,20 +23,164 @@
 
 #include <IOKit/IOService.h>
 #include <IOKit/pci/IOPCIDevice.h>
+#include <kern/clock.h>
+#include "ConfigRead.h"
+#include "KextRangeTable.h"
+#include "OverrideBlob.h"
+#include "PerCPU.h"
 
 class FakePCIID : public IOService
 {
     OSDeclareDefaultStructors(FakePCIID);
     typedef IOService super;
 
+public:
+    // overrides resolved from provider properties when hooked, as the config
+    // header bytes readers see instead of the real ones
+    enum { kOverrideHeaderSize = 64 };
+    struct Overrides
+    {
+        UInt8 bytes[kOverrideHeaderSize];
+        UInt64 mask;                // bit n set: bytes[n] replaces config byte n
+        KextRangeTable* clients;    // FakeClients: only calls from these kexts see overrides (NULL: all)
+    };
+
 protected:
     const void *mDeviceVtable;
     const void *mStubVtable;
     IOPCIDevice* mProvider;
+    Overrides mOverrides;
+
+    // per-client config access profile (RM,profile-rate)
+    enum { kMaxProfileClients = 16, kFreeSlot = 0xFFFFFFFE };
+    struct ProfileCounters
+    {
+        UInt32 tick;                // sampling only, lost updates are harmless
+        volatile UInt32 reads[kMaxProfileClients];
+        volatile UInt32 writes[kMaxProfileClients];
+        volatile SInt64 time[kMaxProfileClients];
+    };
+    UInt32 mProfileRate;
+    volatile UInt32 mProfileTags[kMaxProfileClients];   // client kext loadTag, kFreeSlot if unused
+    KextRangeTable mProfileClients;
+    PerCPU<ProfileCounters> mProfileCounters;           // write-hot
+
+    // kexts allowed to see the overrides (FakeClients)
+    KextRangeTable mClients;
+
+    // refreshes mProfileClients/mClients as kexts load
+    IONotifier* mKextNotifier;
+
+    // probe window: unhook once FakeUnhookAfter client class has started on the provider
+    IONotifier* mProbeWindowNotifier;
+    bool mProbeWindowClosed;
+
+#ifdef DEBUG
+    // config read fault injection (RM,fault-*), debug builds only
+    struct FaultCounters
+    {
+        UInt32 seed;                // per-CPU xorshift state, seeded on first use
+        volatile UInt32 delayed;
+        volatile UInt32 absent;
+    };
+    UInt32 mFaultPercent;           // 0 disables
+    UInt8 mFaultFirst, mFaultLast;  // offset range
+    UInt8 mFaultWidths;             // bit n set: n byte reads
+    UInt32 mFaultDelay;             // microseconds
+    bool mFaultAbsent;              // return all ones
+    PerCPU<FaultCounters> mFaultCounters;
+#endif
+
+    // direct ECAM reads of stable header registers (FakeDirectConfigReads)
+    IOMemoryMap* mConfigMap;
+    volatile UInt32* mConfigWindow;
+    UInt32 mConfigSpace;        // IOPCIAddressSpace bits of the mapped function
+
+    // hooked devices, so PCIDeviceStub can find the FakePCIID for its provider
+    enum { kMaxHooks = 32 };
+    static FakePCIID* volatile sHooks[kMaxHooks];
+
+    // Hooked functions by config address (bus/device/function of the provider's
+    // IOPCIAddressSpace), so a stub call that addresses a sibling function gets
+    // that function's overrides, or none.  Open addressed with linear probing;
+    // lookups are lock free, and there are always free slots (kMaxHooks live keys).
+    enum
+    {
+        kOverrideSlotBits = 6,
+        kOverrideSlots = 1 << kOverrideSlotBits,
+        kOverrideSlotEmpty = 0,
+        kOverrideSlotDeleted = 2,   // real keys always have bit 0 set
+    };
+    struct OverrideSlot
+    {
+        volatile UInt32 key;
+        FakePCIID* volatile hook;
+    };
+    static OverrideSlot sOverrideSlots[kOverrideSlots];
+    UInt32 mOverrideKey;
+
+    // Calls in flight in PCIDeviceStub code (see InFlight), per CPU and per
+    // epoch parity.  Unhook flips the epoch and waits for the old parity to
+    // drain, then does the same for the other parity, so calls that entered
+    // the stub before the vtable was restored have returned by the time
+    // stop()/free() return.  A call re-reads the epoch after counting itself
+    // and counts again if it changed, so it is never counted only in a
+    // parity that has already been drained.
+    struct InFlightCounters
+    {
+        volatile UInt32 entered[2];
+        volatile UInt32 exited[2];
+    } __attribute__((aligned(kPerCPUCacheLine)));
+    static InFlightCounters sInFlight[kPerCPUMaxCPUs];
+    static volatile UInt32 sEpoch;
+    static volatile UInt32 sQuiescing;
+
+    static void drainInFlight(UInt32 parity);
+    static void waitForQuiescence();
+
+    static inline UInt32 overrideKey(IOPCIAddressSpace space)
+        { return (space.bits & 0x00FFFF00) | 1; }
+    static inline UInt32 overrideSlot(UInt32 key)
+        { return (key * 0x9E3779B1) >> (32 - kOverrideSlotBits); }
 
     virtual bool hookProvider(IOService* provider);
     void unhookProvider();
     void mergeFakeProperties(IOService* provider, const char* name, bool force);
+    void mergeProperty(IOService* provider, const char* name, const void* bytes, unsigned length, bool force);
+    bool applyOverrideBlob(IOPCIDevice* provider);
+    virtual void applyWriteRule(IOService* provider, const OverrideBlobWriteRule& rule);
+    // ID fields that can be overridden, and the provider properties naming them
+    struct OverrideField
+    {
+        UInt8 offset;
+        UInt8 size;
+        const char* name;
+        const char* alternateName;
+    };
+    enum { kOverrideFieldCount = 5 };
+    static const OverrideField kOverrideFields[kOverrideFieldCount];
+
+    void loadOverrides();
+    void loadOverride(const OverrideField& field);
+    bool registerHook();
+    void unregisterHook();
+    void initProfile();
+    void freeProfile();
+    void initClients();
+    void freeClients();
+    void watchKexts();
+    void unwatchKexts();
+    bool kextLoaded(void* refCon, IOService* newService, IONotifier* notifier);
+#ifdef DEBUG
+    void initFaults();
+    void freeFaults();
+#endif
+    IOPhysicalAddress findECAMWindow(IOPCIAddressSpace space);
+    void initDirectReads();
+    void freeDirectReads();
+    void initProbeWindow();
+    void freeProbeWindow();
+    bool providerMatched(void* refCon, IOService* newService, IONotifier* notifier);
 
     static inline const void *getVTable(const IOPCIDevice *object)
         { return *(const void *const *)object; }
@@ -44,11 +188,119 @@ protected:
         { *(const void **)object = vtable; }
 
 public:
+    // declared first thing in every hooked method, so unhook can wait for the call
+    class InFlight
+    {
+    public:
+        inline InFlight()
+        {
+            for (;;)
+            {
+                UInt32 epoch = sEpoch;
+                mParity = epoch & 1;
+                OSIncrementAtomic(&sInFlight[cpu_number() & (kPerCPUMaxCPUs - 1)].entered[mParity]);
+                // if the epoch flipped between the load and the increment, the
+                // drain of the old parity may already have missed us: move to
+                // the current one
+                if (sEpoch == epoch)
+                    break;
+                OSIncrementAtomic(&sInFlight[cpu_number() & (kPerCPUMaxCPUs - 1)].exited[mParity]);
+            }
+        }
+        inline ~InFlight()
+            { OSIncrementAtomic(&sInFlight[cpu_number() & (kPerCPUMaxCPUs - 1)].exited[mParity]); }
+    private:
+        UInt32 mParity;
+    };
+
+    // linear scan of sHooks, for cold paths; the stub uses findHook(space)
+    static FakePCIID* getHook(const IOPCIDevice* device);
+
+    // picks up kexts loaded since the last update, for FakeClients and RM,Profile
+    void updateKextTables();
+
+    // hook of the hooked function at space, NULL if it is not hooked; for
+    // the stub's own provider, this is the hook that installed the stub
+    static inline FakePCIID* findHook(IOPCIAddressSpace space)
+    {
+        UInt32 key = overrideKey(space);
+        UInt32 slot = overrideSlot(key);
+        for (int probe = 0; probe < kOverrideSlots; probe++, slot = (slot + 1) & (kOverrideSlots - 1))
+        {
+            UInt32 slotKey = sOverrideSlots[slot].key;
+            if (slotKey == key)
+            {
+                // slot may be mid insert/remove
+                FakePCIID* hook = sOverrideSlots[slot].hook;
+                return hook && hook->mOverrideKey == key ? hook : NULL;
+            }
+            if (slotKey == kOverrideSlotEmpty)
+                break;
+        }
+        return NULL;
+    }
+
+    // overrides of the hooked function at space, NULL if it is not hooked
+    static inline const Overrides* findOverrides(IOPCIAddressSpace space)
+    {
+        FakePCIID* hook = findHook(space);
+        return hook ? &hook->mOverrides : NULL;
+    }
+
+    // sampled profiling of hooked config accesses
+    inline UInt64 profileBegin()
+    {
+        if (!mProfileRate || ++mProfileCounters.local().tick % mProfileRate)
+            return 0;
+        return mach_absolute_time();
+    }
+    void profileEnd(UInt64 start, const void* caller, const void* callerCaller, bool write);
+
+#ifdef DEBUG
+    // delays and/or fails a fraction of reads to the configured offsets;
+    // returns true if the read should return all ones (device absent)
+    inline bool injectFault(UInt8 offset, unsigned width)
+    {
+        if (!mFaultPercent || offset < mFaultFirst || offset > mFaultLast || !(mFaultWidths & width))
+            return false;
+        FaultCounters& counters = mFaultCounters.local();
+        UInt32 seed = counters.seed;
+        if (!seed)
+            seed = (UInt32)mach_absolute_time() | 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        counters.seed = seed;
+        if (seed % 100 >= mFaultPercent)
+            return false;
+        if (mFaultDelay)
+        {
+            IODelay(mFaultDelay);
+            OSIncrementAtomic(&counters.delayed);
+        }
+        if (mFaultAbsent)
+            OSIncrementAtomic(&counters.absent);
+        return mFaultAbsent;
+    }
+#endif
+
+    // passthrough read of a stable header register straight from ECAM (width in bytes);
+    // false if not enabled or not eligible, and the caller goes through IOPCIFamily
+    inline bool directRead(IOPCIAddressSpace space, UInt8 offset, unsigned width, UInt32& result) const
+    {
+        volatile UInt32* window = mConfigWindow;
+        if (!window || space.bits != mConfigSpace)
+            return false;
+        // false if not responding (powered down?), let IOPCIFamily handle it
+        return ecamConfigRead(window, kDirectReadDwords, offset, width, result);
+    }
+
     virtual bool init(OSDictionary *propTable);
     virtual bool attach(IOService *provider);
     virtual bool start(IOService *provider);
     virtual void stop(IOService *provider);
     virtual void free();
+    virtual bool serializeProperties(OSSerialize* s) const;
 #ifdef DEBUG
     virtual void detach(IOService *provider);
 #endif
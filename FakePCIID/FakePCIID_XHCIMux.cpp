@@ -25,6 +25,19 @@
 
 //////////////////////////////////////////////////////////////////////////////
 
+// in startup write order: SuperSpeed terminations are enabled before USB2
+// ports are routed to XHCI, as in the BIOS handoff sequence
+static const XHCIMuxRegister kMuxRegisters[] =
+{
+    { "USB3_PSSEN", kXHCI_PCIConfig_USB3PSSEN, kXHCI_PCIConfig_USB3PRM,
+      kPSSENForce, kPSSENInit, kPSSENBlock, kUSB3PRMBlock, kPSSENHonorUSB3PRM, kPSSENChipsetMask, false },
+    { "PR2", kXHCI_PCIConfig_PR2, kXHCI_PCIConfig_PR2M,
+      kPR2Force, kPR2Init, kPR2Block, kPR2MBlock, kPR2HonorPR2M, kPR2ChipsetMask, true },
+};
+#define kMuxRegisterCount (sizeof(kMuxRegisters)/sizeof(kMuxRegisters[0]))
+
+//////////////////////////////////////////////////////////////////////////////
+
 OSDefineMetaClassAndStructors(FakePCIID_XHCIMux, FakePCIID);
 
 bool FakePCIID_XHCIMux::init(OSDictionary *propTable)
@@ -39,6 +52,11 @@ bool FakePCIID_XHCIMux::init(OSDictionary *propTable)
     mStubVtable = getVTable(stub);
     stub->release();
 
+    mShadowValid = 0;
+    mStartupCall = NULL;
+    mStartupLock = NULL;
+    mStartupDone = true;
+
     return true;
 }
 
@@ -50,15 +68,142 @@ bool FakePCIID_XHCIMux::hookProvider(IOService *provider)
     bool init = !mDeviceVtable;
     bool result = super::hookProvider(provider);
 
-    // write initial value to PR2 early...
-    if (init)
-        ((PCIDeviceStub_XHCIMux*)provider)->startup();
+    // program mux registers early, off the matching thread...
+    if (init && mDeviceVtable)
+    {
+        if (!mStartupLock)
+            mStartupLock = IOLockAlloc();
+        if (!mStartupCall)
+            mStartupCall = thread_call_allocate(startupThread, this);
+        mStartupDone = false;
+        retain();   // released by startupThread
+        if (mStartupLock && mStartupCall)
+            thread_call_enter(mStartupCall);
+        else
+            startupThread(this, NULL);  // no thread call, program synchronously
+    }
 
     return result;
 }
 
+void FakePCIID_XHCIMux::startupThread(thread_call_param_t param0, thread_call_param_t param1)
+{
+    FakePCIID_XHCIMux* self = static_cast<FakePCIID_XHCIMux*>(param0);
+
+    ((PCIDeviceStub_XHCIMux*)self->mProvider)->startup();
+
+    if (self->mStartupLock)
+        IOLockLock(self->mStartupLock);
+    self->mStartupDone = true;
+    if (self->mStartupLock)
+    {
+        IOLockWakeup(self->mStartupLock, (void*)&self->mStartupDone, false);
+        IOLockUnlock(self->mStartupLock);
+    }
+    self->release();
+}
+
+void FakePCIID_XHCIMux::waitForStartupSlow()
+{
+    IOLockLock(mStartupLock);
+    while (!mStartupDone)
+        IOLockSleep(mStartupLock, (void*)&mStartupDone, THREAD_UNINT);
+    IOLockUnlock(mStartupLock);
+}
+
+bool FakePCIID_XHCIMux::start(IOService *provider)
+{
+    DebugLog("FakePCIID_XHCIMux::start\n");
+
+    // no wait for the startup programming here: the stub waits for it before
+    // any access to the mux registers, so matching carries on meanwhile
+    return super::start(provider);
+}
+
+void FakePCIID_XHCIMux::stop(IOService *provider)
+{
+    DebugLog("FakePCIID_XHCIMux::stop\n");
+
+    waitForStartup();
+    super::stop(provider);
+}
+
+void FakePCIID_XHCIMux::free()
+{
+    DebugLog("FakePCIID_XHCIMux::free\n");
+
+    // startupThread holds a reference, so it is not pending here
+    if (mStartupCall)
+    {
+        thread_call_free(mStartupCall);
+        mStartupCall = NULL;
+    }
+    if (mStartupLock)
+    {
+        IOLockFree(mStartupLock);
+        mStartupLock = NULL;
+    }
+    super::free();
+}
+
+void FakePCIID_XHCIMux::applyWriteRule(IOService* provider, const OverrideBlobWriteRule& rule)
+{
+    // write rules compiled from the RM,pr2*/RM,pssen* FakeProperties map back to those properties
+    UInt8 block = (rule.flags & kOverrideRuleBlock) != 0;
+    bool force = (rule.flags & kOverrideRuleForced) != 0;
+    for (unsigned i = 0; i < kMuxRegisterCount; i++)
+    {
+        const XHCIMuxRegister& reg = kMuxRegisters[i];
+        if (rule.offset == reg.offset)
+        {
+            UInt8 init = (rule.flags & kOverrideRuleInit) != 0;
+            UInt8 honor = (rule.flags & kOverrideRuleHonorMask) != 0;
+            UInt32 value = rule.force, mask = rule.mask;
+            // only the properties the injector had, so defaults (and whether
+            // the register is managed at all) are as without FakeOverrides
+            if (rule.present & kOverrideRulePresentForce)
+                mergeProperty(provider, reg.force, &value, sizeof(value), force);
+            if (rule.present & kOverrideRulePresentInit)
+                mergeProperty(provider, reg.init, &init, sizeof(init), force);
+            if (rule.present & kOverrideRulePresentBlock)
+                mergeProperty(provider, reg.block, &block, sizeof(block), force);
+            if (rule.present & kOverrideRulePresentHonor)
+                mergeProperty(provider, reg.honorMask, &honor, sizeof(honor), force);
+            if (rule.present & kOverrideRulePresentMask)
+                mergeProperty(provider, reg.chipsetMask, &mask, sizeof(mask), force);
+            return;
+        }
+        if (rule.offset == reg.maskOffset)
+        {
+            if (rule.present & kOverrideRulePresentBlock)
+                mergeProperty(provider, reg.maskBlock, &block, sizeof(block), force);
+            return;
+        }
+    }
+    super::applyWriteRule(provider, rule);
+}
+
+void FakePCIID_XHCIMux::setShadow(UInt8 offset, UInt32 value)
+{
+    unsigned index = (offset - kShadowFirst) >> 2;
+    mShadow[index] = value;
+    OSBitOrAtomic(1 << index, &mShadowValid);
+}
+
+void FakePCIID_XHCIMux::clearShadow(UInt8 offset)
+{
+    unsigned index = (offset - kShadowFirst) >> 2;
+    OSBitAndAtomic(~(1 << index), &mShadowValid);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
+// the stub vtable is only installed by FakePCIID_XHCIMux
+static inline FakePCIID_XHCIMux* getMuxHook(IOPCIAddressSpace space)
+{
+    return static_cast<FakePCIID_XHCIMux*>(FakePCIID::findHook(space));
+}
+
 hack_OSDefineMetaClassAndStructors(PCIDeviceStub_XHCIMux, PCIDeviceStub);
 
 bool PCIDeviceStub_XHCIMux::getBoolProperty(const char* name, bool defValue)
@@ -79,92 +224,179 @@ UInt32 PCIDeviceStub_XHCIMux::getUInt32Property(const char* name)
     return result;
 }
 
+bool PCIDeviceStub_XHCIMux::isManaged(const XHCIMuxRegister& reg)
+{
+    return reg.alwaysManaged || getProperty(reg.force);
+}
+
+UInt32 PCIDeviceStub_XHCIMux::getMuxMask(const XHCIMuxRegister& reg)
+{
+    if (getBoolProperty(reg.honorMask, true))
+        return super::configRead32(super::space, reg.maskOffset);
+    return getUInt32Property(reg.chipsetMask);
+}
+
+UInt32 PCIDeviceStub_XHCIMux::getMuxValue(const XHCIMuxRegister& reg, UInt32 mask, UInt32 current)
+{
+    return (current & ~mask) | (getUInt32Property(reg.force) & mask);
+}
+
+bool PCIDeviceStub_XHCIMux::attachToChild(IORegistryEntry* child, const IORegistryPlane* plane)
+{
+    FakePCIID::InFlight inFlight;
+    // a client driver (AppleUSBXHCI) is attached just before its probe(), so
+    // it only sees the controller with the ports routed; FakePCIID_XHCIMux
+    // itself is attached through the stub too (attach hooks first), and is
+    // not held up
+    FakePCIID_XHCIMux* hook = getMuxHook(super::space);
+    if (hook && child != hook)
+        hook->waitForStartup();
+    return super::attachToChild(child, plane);
+}
+
+UInt32 PCIDeviceStub_XHCIMux::configRead32(IOPCIAddressSpace space, UInt8 offset)
+{
+    FakePCIID::InFlight inFlight;
+    FakePCIID_XHCIMux* hook = getMuxHook(super::space);
+    if (hook && FakePCIID_XHCIMux::isMuxRange(offset))
+        hook->waitForStartup();
+    UInt32 result;
+    if (hook && space.bits == super::space.bits && hook->readShadow(offset, sizeof(UInt32), result))
+        return result;
+    // not through PCIDeviceStub::configRead*, which would take this function as the caller
+    return configReadCore<UInt32>(space, offset, __builtin_return_address(0));
+}
+
+UInt16 PCIDeviceStub_XHCIMux::configRead16(IOPCIAddressSpace space, UInt8 offset)
+{
+    FakePCIID::InFlight inFlight;
+    FakePCIID_XHCIMux* hook = getMuxHook(super::space);
+    if (hook && FakePCIID_XHCIMux::isMuxRange(offset))
+        hook->waitForStartup();
+    UInt32 result;
+    if (hook && space.bits == super::space.bits && hook->readShadow(offset, sizeof(UInt16), result))
+        return result;
+    return configReadCore<UInt16>(space, offset, __builtin_return_address(0));
+}
+
+UInt8 PCIDeviceStub_XHCIMux::configRead8(IOPCIAddressSpace space, UInt8 offset)
+{
+    FakePCIID::InFlight inFlight;
+    FakePCIID_XHCIMux* hook = getMuxHook(super::space);
+    if (hook && FakePCIID_XHCIMux::isMuxRange(offset))
+        hook->waitForStartup();
+    UInt32 result;
+    if (hook && space.bits == super::space.bits && hook->readShadow(offset, sizeof(UInt8), result))
+        return result;
+    return configReadCore<UInt8>(space, offset, __builtin_return_address(0));
+}
+
 void PCIDeviceStub_XHCIMux::configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32 data)
 {
+    FakePCIID::InFlight inFlight;
+    FakePCIID_XHCIMux* hook = getMuxHook(super::space);
+    if (hook && FakePCIID_XHCIMux::isMuxRange(offset))
+        hook->waitForStartup();
+    UInt64 profile = hook ? hook->profileBegin() : 0;
+
     UInt32 deviceInfo = super::configRead32(space, kIOPCIConfigVendorID);
     DebugLog("[%04x:%04x] XHCIMux::configWrite32 address space(0x%08x, 0x%02x) data: 0x%08x\n",
              deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data);
 
     UInt32 newData = data;
-    switch (offset)
+    bool blocked = false;
+    for (unsigned i = 0; i < kMuxRegisterCount && !blocked; i++)
     {
-        case kXHCI_PCIConfig_PR2:
+        const XHCIMuxRegister& reg = kMuxRegisters[i];
+        if (offset == reg.offset && isManaged(reg))
         {
-            if (getBoolProperty(kPR2Block, false))
-            {
-                AlwaysLog("[%04x:%04x] XHCIMux::configWrite32 address space(0x%08x, 0x%02x) data: 0x%08x blocked\n",
-                          deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data);
-                return;
-            }
-            UInt32 mask;
-            if (getBoolProperty(kPR2HonorPR2M, true))
-                mask = super::configRead32(super::space, kXHCI_PCIConfig_PR2M);
+            if (getBoolProperty(reg.block, false))
+                blocked = true;
             else
-                mask = getUInt32Property(kPR2ChipsetMask);
-            newData = super::configRead32(space, kXHCI_PCIConfig_PR2);
-            newData &= ~mask;
-            newData |= getUInt32Property(kPR2Force) & mask;
+                newData = getMuxValue(reg, getMuxMask(reg), super::configRead32(space, reg.offset));
         }
-            break;
-
-        case kXHCI_PCIConfig_PR2M:
+        else if (offset == reg.maskOffset && getBoolProperty(reg.maskBlock, false))
+            blocked = true;
+    }
+    if (blocked)
+    {
+        AlwaysLog("[%04x:%04x] XHCIMux::configWrite32 address space(0x%08x, 0x%02x) data: 0x%08x blocked\n",
+                  deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data);
+    }
+    else
+    {
+        if (newData != data)
         {
-            if (getBoolProperty(kPR2MBlock, false))
-            {
-                AlwaysLog("[%04x:%04x] XHCIMux::configWrite32 address space(0x%08x, 0x%02x) data: 0x%08x blocked\n",
-                          deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data);
-                return;
-            }
+            AlwaysLog("[%04x:%04x] XHCIMux::configWrite32 address space(0x%08x, 0x%02x) data: 0x%08x -> 0x%08x\n",
+                      deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data, newData);
         }
-            break;
+
+        superConfigWrite(space, offset, newData);
     }
 
-    if (newData != data)
+    // reads now return what the driver wrote, or hardware if that is the same
+    if (hook && space.bits == super::space.bits && FakePCIID_XHCIMux::isShadowed(offset, sizeof(data)))
     {
-        AlwaysLog("[%04x:%04x] XHCIMux::configWrite32 address space(0x%08x, 0x%02x) data: 0x%08x -> 0x%08x\n",
-                  deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data, newData);
+        if (blocked || newData != data)
+            hook->setShadow(offset, data);
+        else
+            hook->clearShadow(offset);
     }
 
-    super::configWrite32(space, offset, newData);
+    // caller's caller only for a sample
+    if (profile)
+        hook->profileEnd(profile, __builtin_return_address(0), __builtin_return_address(1), true);
 }
 
 void PCIDeviceStub_XHCIMux::startup()
 {
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
 
-    UInt32 mask;
-    if (getBoolProperty(kPR2HonorPR2M, true))
-        mask = super::configRead32(super::space, kXHCI_PCIConfig_PR2M);
-    else
-        mask = getUInt32Property(kPR2ChipsetMask);
-    UInt32 newData = super::configRead32(super::space, kXHCI_PCIConfig_PR2);
-    newData &= ~mask;
-    newData |= getUInt32Property(kPR2Force) & mask;
-    AlwaysLog("[%04x:%04x] XHCIMux::startup: newData for PR2: 0x%08x\n", deviceInfo & 0xFFFF, deviceInfo >> 16, newData);
+    // compute every target from one snapshot of the mask and current values,
+    // so no write below can change the inputs of another
+    bool pending[kMuxRegisterCount];
+    UInt32 newData[kMuxRegisterCount];
+    for (unsigned i = 0; i < kMuxRegisterCount; i++)
+    {
+        const XHCIMuxRegister& reg = kMuxRegisters[i];
+        pending[i] = isManaged(reg) && getBoolProperty(reg.init, true);
+        if (pending[i])
+            newData[i] = getMuxValue(reg, getMuxMask(reg), super::configRead32(super::space, reg.offset));
+    }
 
-    super::configWrite32(super::space, kXHCI_PCIConfig_PR2, newData);
+    // ...then write them as one ordered batch
+    for (unsigned i = 0; i < kMuxRegisterCount; i++)
+    {
+        if (!pending[i])
+            continue;
+        const XHCIMuxRegister& reg = kMuxRegisters[i];
+        AlwaysLog("[%04x:%04x] XHCIMux::startup: newData for %s: 0x%08x\n", deviceInfo & 0xFFFF, deviceInfo >> 16, reg.name, newData[i]);
+        superConfigWrite(super::space, reg.offset, newData[i]);
+    }
 }
 
 #ifdef HOOK_ALL
 
 void PCIDeviceStub_XHCIMux::configWrite16(IOPCIAddressSpace space, UInt8 offset, UInt16 data)
 {
-    UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
+    FakePCIID::InFlight inFlight;
+    configWriteCore<UInt16>(space, offset, data, __builtin_return_address(0));
 
-    DebugLog("[%04x:%04x] configWrite16 address space(0x%08x, 0x%02x) data: 0x%04x\n",
-             deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data);
-
-    super::configWrite16(space, offset, data);
+    // partial write goes to hardware, so the virtual copy is stale
+    FakePCIID_XHCIMux* hook = getMuxHook(super::space);
+    if (hook && space.bits == super::space.bits && FakePCIID_XHCIMux::isShadowed(offset & ~3, sizeof(UInt32)))
+        hook->clearShadow(offset);
 }
 
 void PCIDeviceStub_XHCIMux::configWrite8(IOPCIAddressSpace space, UInt8 offset, UInt8 data)
 {
-    UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
-
-    DebugLog("[%04x:%04x] configWrite8 address space(0x%08x, 0x%02x) data: 0x%02x\n",
-             deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data);
+    FakePCIID::InFlight inFlight;
+    configWriteCore<UInt8>(space, offset, data, __builtin_return_address(0));
 
-    super::configWrite8(space, offset, data);
+    // partial write goes to hardware, so the virtual copy is stale
+    FakePCIID_XHCIMux* hook = getMuxHook(super::space);
+    if (hook && space.bits == super::space.bits && FakePCIID_XHCIMux::isShadowed(offset & ~3, sizeof(UInt32)))
+        hook->clearShadow(offset);
 }
 
 #endif
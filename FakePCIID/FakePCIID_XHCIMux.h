@@ -23,21 +23,73 @@
 
 #include <IOKit/IOService.h>
 #include <IOKit/pci/IOPCIDevice.h>
+#include <kern/thread_call.h>
+#include "ConfigRead.h"
 #include "FakePCIID.h"
 #include "PCIDeviceStub.h"
 
+#define kXHCI_PCIConfig_PR2         0xd0
+#define kXHCI_PCIConfig_PR2M        0xd4
+#define kXHCI_PCIConfig_USB3PSSEN   0xd8
+#define kXHCI_PCIConfig_USB3PRM     0xdc
+
 class FakePCIID_XHCIMux : public FakePCIID
 {
     OSDeclareDefaultStructors(FakePCIID_XHCIMux);
     typedef FakePCIID super;
 
+protected:
+    // Virtual copy of the mux registers (PR2 through USB3PRM): the last value
+    // the driver wrote, where the write was blocked or rewritten by policy.
+    // Reads return it, so a driver verifying its write sees what it wrote,
+    // while the hardware keeps the policy value.
+    enum { kShadowFirst = kXHCI_PCIConfig_PR2, kShadowCount = 4 };
+    volatile UInt32 mShadow[kShadowCount];
+    volatile UInt32 mShadowValid;   // bit n set: mShadow[n] is valid
+
+    // startup() runs on a thread call as soon as the provider is hooked, so
+    // attach returns right away; waitForStartup() is the barrier before a
+    // client driver is attached to the controller, before the mux registers
+    // are touched by anyone else, and before stop() returns
+    thread_call_t mStartupCall;
+    IOLock* mStartupLock;
+    volatile bool mStartupDone;
+
+    static void startupThread(thread_call_param_t param0, thread_call_param_t param1);
+    void waitForStartupSlow();
+
+    virtual void applyWriteRule(IOService* provider, const OverrideBlobWriteRule& rule);
+
 public:
     virtual bool init(OSDictionary *propTable);
     virtual bool hookProvider(IOService *provider);
-};
+    virtual bool start(IOService *provider);
+    virtual void stop(IOService *provider);
+    virtual void free();
 
-#define kXHCI_PCIConfig_PR2     0xd0
-#define kXHCI_PCIConfig_PR2M    0xd4
+    static inline bool isMuxRange(UInt8 offset)
+        { return offset >= kShadowFirst && offset < kShadowFirst + 4 * kShadowCount; }
+    inline void waitForStartup()
+        { if (!mStartupDone) waitForStartupSlow(); }
+
+    static inline bool isShadowed(UInt8 offset, unsigned width)
+    {
+        return offset >= kShadowFirst && offset + width <= kShadowFirst + 4 * kShadowCount && (offset & 3) + width <= 4;
+    }
+    inline bool readShadow(UInt8 offset, unsigned width, UInt32& result) const
+    {
+        offset = configReadAlign(offset, width);
+        if (!isShadowed(offset, width))
+            return false;
+        unsigned index = (offset - kShadowFirst) >> 2;
+        if (!(mShadowValid & (1 << index)))
+            return false;
+        result = mShadow[index] >> (8 * (offset & 3));
+        return true;
+    }
+    void setShadow(UInt8 offset, UInt32 value);
+    void clearShadow(UInt8 offset);
+};
 
 #define kPR2Force       "RM,pr2-force"
 #define kPR2Init        "RM,pr2-init"
@@ -46,6 +98,29 @@ public:
 #define kPR2HonorPR2M   "RM,pr2-honor-pr2m"
 #define kPR2ChipsetMask "RM,pr2-chipset-mask"
 
+#define kPSSENForce         "RM,pssen-force"
+#define kPSSENInit          "RM,pssen-init"
+#define kPSSENBlock         "RM,pssen-block"
+#define kUSB3PRMBlock       "RM,usb3prm-block"
+#define kPSSENHonorUSB3PRM  "RM,pssen-honor-usb3prm"
+#define kPSSENChipsetMask   "RM,pssen-chipset-mask"
+
+// A mux register (XUSB2PR, USB3_PSSEN), the BIOS provided mask register that
+// qualifies it, and the properties controlling both.
+struct XHCIMuxRegister
+{
+    const char* name;
+    UInt8 offset;
+    UInt8 maskOffset;
+    const char* force;
+    const char* init;
+    const char* block;
+    const char* maskBlock;
+    const char* honorMask;
+    const char* chipsetMask;
+    bool alwaysManaged;     // otherwise managed only if the force property is present
+};
+
 class PCIDeviceStub_XHCIMux : public PCIDeviceStub
 {
     OSDeclareDefaultStructors(PCIDeviceStub_XHCIMux);
@@ -55,12 +130,20 @@ protected:
     bool getBoolProperty(const char* name, bool defValue);
     UInt32 getUInt32Property(const char* name);
 
+    bool isManaged(const XHCIMuxRegister& reg);
+    UInt32 getMuxMask(const XHCIMuxRegister& reg);
+    UInt32 getMuxValue(const XHCIMuxRegister& reg, UInt32 mask, UInt32 current);
+
 public:
+    virtual UInt32 configRead32(IOPCIAddressSpace space, UInt8 offset);
+    virtual UInt16 configRead16(IOPCIAddressSpace space, UInt8 offset);
+    virtual UInt8 configRead8(IOPCIAddressSpace space, UInt8 offset);
     virtual void configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32 data);
 #ifdef HOOK_ALL
     virtual void configWrite16(IOPCIAddressSpace space, UInt8 offset, UInt16 data);
     virtual void configWrite8(IOPCIAddressSpace space, UInt8 offset, UInt8 data);
 #endif
+    virtual bool attachToChild(IORegistryEntry* child, const IORegistryPlane* plane);
 
     void startup();
 };
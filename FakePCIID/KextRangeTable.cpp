@@ -0,0 +1,358 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <IOKit/IOLib.h>
+#include <libkern/libkern.h>
+#include "KextRangeTable.h"
+#include "PCIDeviceStub.h"
+
+#define kIOPCIFamilyName "com.apple.iokit.IOPCIFamily"
+
+extern kmod_info_t kmod_info;
+
+static int compareRanges(const void* a, const void* b)
+{
+    // Range::start is the first member
+    UInt64 left = *static_cast<const UInt64*>(a);
+    UInt64 right = *static_cast<const UInt64*>(b);
+    return left < right ? -1 : left > right;
+}
+
+static bool addString(OSArray* array, const char* string)
+{
+    const OSSymbol* symbol = OSSymbol::withCString(string);
+    if (!symbol)
+        return false;
+    bool result = array->setObject(symbol);
+    symbol->release();
+    return result;
+}
+
+bool KextRangeTable::init(OSArray* names)
+{
+    mBuffers[0].ranges = mBuffers[1].ranges = NULL;
+    mBuffers[0].names = mBuffers[1].names = NULL;
+    mBuffers[0].count = mBuffers[1].count = 0;
+    mActive = &mBuffers[0];
+    mCapacity = 0;
+    mKextCount = 0;
+    mLatestLoadTag = 0;
+    mIdentifiers = NULL;
+    mInfoKeys = NULL;
+    mNames = names;
+    if (mNames)
+        mNames->retain();
+
+    mLock = IOLockAlloc();
+    if (!mLock || !mPins.init())
+        return false;
+
+    // FakePCIID itself is always asked for, to find the address slide
+    mInfoKeys = OSArray::withCapacity(3);
+    if (!mInfoKeys || !addString(mInfoKeys, kOSBundleLoadTagKey) ||
+        !addString(mInfoKeys, kOSBundleLoadAddressKey) || !addString(mInfoKeys, kOSBundleLoadSizeKey))
+        return false;
+    if (mNames)
+    {
+        mIdentifiers = OSArray::withCapacity(mNames->getCount() + 2);
+        if (!mIdentifiers || !addString(mIdentifiers, kIOPCIFamilyName) || !addString(mIdentifiers, kmod_info.name))
+            return false;
+        for (unsigned i = 0; i < mNames->getCount(); i++)
+        {
+            OSString* name = OSDynamicCast(OSString, mNames->getObject(i));
+            if (name && !addString(mIdentifiers, name->getCStringNoCopy()))
+                return false;
+        }
+    }
+
+    return update();
+}
+
+void KextRangeTable::free()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (mBuffers[i].ranges)
+            IOFree(mBuffers[i].ranges, mCapacity * sizeof(Range));
+        if (mBuffers[i].names)
+            IOFree(mBuffers[i].names, mCapacity * sizeof(Name));
+        mBuffers[i].ranges = NULL;
+        mBuffers[i].names = NULL;
+        mBuffers[i].count = 0;
+    }
+    mPins.free();
+    if (mLock)
+    {
+        IOLockFree(mLock);
+        mLock = NULL;
+    }
+    if (mNames)
+    {
+        mNames->release();
+        mNames = NULL;
+    }
+    if (mIdentifiers)
+    {
+        mIdentifiers->release();
+        mIdentifiers = NULL;
+    }
+    if (mInfoKeys)
+    {
+        mInfoKeys->release();
+        mInfoKeys = NULL;
+    }
+}
+
+bool KextRangeTable::isIncluded(const char* name) const
+{
+    if (!mNames)
+        return true;
+    if (0 == strcmp(name, kIOPCIFamilyName))
+        return true;
+    for (unsigned i = 0; i < mNames->getCount(); i++)
+    {
+        OSString* include = OSDynamicCast(OSString, mNames->getObject(i));
+        if (include && include->isEqualTo(name))
+            return true;
+    }
+    return false;
+}
+
+bool KextRangeTable::getKextInfo(OSObject* object, UInt64& address, UInt64& size, UInt32& loadTag)
+{
+    OSDictionary* info = OSDynamicCast(OSDictionary, object);
+    if (!info)
+        return false;
+    OSNumber* num = OSDynamicCast(OSNumber, info->getObject(kOSBundleLoadTagKey));
+    if (!num)
+        return false;
+    loadTag = num->unsigned32BitValue();
+    num = OSDynamicCast(OSNumber, info->getObject(kOSBundleLoadAddressKey));
+    address = num ? num->unsigned64BitValue() : 0;
+    num = OSDynamicCast(OSNumber, info->getObject(kOSBundleLoadSizeKey));
+    size = num ? num->unsigned64BitValue() : 0;
+    return true;
+}
+
+bool KextRangeTable::update()
+{
+    if (!mLock || !mInfoKeys)
+        return false;
+
+    // outside the lock: takes the kext lock and allocates
+    OSDictionary* infos = OSKextCopyLoadedKextInfo(mIdentifiers, mInfoKeys);
+    OSCollectionIterator* iter = infos ? OSCollectionIterator::withCollection(infos) : NULL;
+    if (!iter)
+    {
+        if (infos)
+            infos->release();
+        return false;
+    }
+
+    IOLockLock(mLock);
+
+    // load tags are never reused, so a kext unloaded and loaded again (same
+    // count) still shows up as a new latest tag.  Load addresses are reported
+    // unslid, as for kextstat; FakePCIID's own entry gives the slide.
+    UInt32 count = 0, latestLoadTag = 0;
+    UInt64 slide = 0;
+    while (const OSSymbol* name = OSDynamicCast(OSSymbol, iter->getNextObject()))
+    {
+        UInt64 address, size;
+        UInt32 loadTag;
+        if (!getKextInfo(infos->getObject(name), address, size, loadTag))
+            continue;
+        count++;
+        if (loadTag > latestLoadTag)
+            latestLoadTag = loadTag;
+        if (name->isEqualTo(kmod_info.name) && address)
+            slide = kmod_info.address - address;
+    }
+    if (count == mKextCount && latestLoadTag == mLatestLoadTag && mActive->count)
+    {
+        IOLockUnlock(mLock);
+        iter->release();
+        infos->release();
+        return true;
+    }
+
+    // buffers are sized once; leave plenty of room for kexts loaded later
+    if (!mCapacity)
+    {
+        mCapacity = count * 2 + 64;
+        for (int i = 0; i < 2; i++)
+        {
+            mBuffers[i].ranges = (Range*)IOMalloc(mCapacity * sizeof(Range));
+            mBuffers[i].names = (Name*)IOMalloc(mCapacity * sizeof(Name));
+            if (!mBuffers[i].ranges || !mBuffers[i].names)
+            {
+                IOLockUnlock(mLock);
+                iter->release();
+                infos->release();
+                return false;
+            }
+        }
+    }
+    if (count > mCapacity)
+        AlwaysLog("KextRangeTable: %u loaded kexts, only %u tracked\n", count, mCapacity);
+
+    Buffer* next = (mActive == &mBuffers[0]) ? &mBuffers[1] : &mBuffers[0];
+    // lookups that pinned this buffer before the last update published the
+    // other one may still be searching it
+    while (pinned(next))
+        IODelay(1);
+    UInt32 used = 0;
+    iter->reset();
+    while (const OSSymbol* name = OSDynamicCast(OSSymbol, iter->getNextObject()))
+    {
+        UInt64 address, size;
+        UInt32 loadTag;
+        if (used == mCapacity)
+            break;
+        if (!getKextInfo(infos->getObject(name), address, size, loadTag) ||
+            !address || !size || !isIncluded(name->getCStringNoCopy()))
+            continue;
+        Range& range = next->ranges[used];
+        range.start = address + slide;
+        range.end = address + slide + size;
+        range.loadTag = loadTag;
+        range.transit = name->isEqualTo(kIOPCIFamilyName);
+        next->names[used].loadTag = loadTag;
+        strlcpy(next->names[used].name, name->getCStringNoCopy(), sizeof(next->names[used].name));
+        used++;
+    }
+    qsort(next->ranges, used, sizeof(Range), compareRanges);
+    next->count = used;
+
+    // publish the completed buffer
+    __sync_synchronize();
+    mActive = next;
+    __sync_synchronize();
+    mKextCount = count;
+    mLatestLoadTag = latestLoadTag;
+
+    IOLockUnlock(mLock);
+    iter->release();
+    infos->release();
+    return true;
+}
+
+KextRangeTable::Buffer* KextRangeTable::acquire() const
+{
+    for (;;)
+    {
+        Buffer* buffer = mActive;
+        int index = buffer - mBuffers;
+        OSIncrementAtomic(&mPins.local().readers[index]);
+        // still active after pinning: update() will not touch it until released
+        if (buffer == mActive)
+            return buffer;
+        OSDecrementAtomic(&mPins.local().readers[index]);
+    }
+}
+
+void KextRangeTable::release(const Buffer* buffer) const
+{
+    // may be another CPU's slot than the pin if the thread migrated; only the sum counts
+    OSDecrementAtomic(&mPins.local().readers[buffer - mBuffers]);
+}
+
+UInt32 KextRangeTable::pinned(const Buffer* buffer) const
+{
+    UInt32 readers = 0;
+    for (int cpu = 0; cpu < PerCPU<Pins>::kMaxCPUs; cpu++)
+        readers += mPins[cpu].readers[buffer - mBuffers];
+    return readers;
+}
+
+const KextRangeTable::Range* KextRangeTable::find(const Buffer* buffer, const void* address)
+{
+    UInt64 addr = (UInt64)address;
+
+    // binary search for the last range starting at or below addr
+    UInt32 lo = 0, hi = buffer->count;
+    while (lo < hi)
+    {
+        UInt32 mid = (lo + hi) / 2;
+        if (buffer->ranges[mid].start <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return NULL;
+    const Range* range = &buffer->ranges[lo - 1];
+    return addr < range->end ? range : NULL;
+}
+
+const KextRangeTable::Range* KextRangeTable::findClient(const Buffer* buffer, const void* caller, const void* callerCaller)
+{
+    const Range* range = find(buffer, caller);
+    if (range && range->transit && callerCaller)
+        range = find(buffer, callerCaller);
+    return range;
+}
+
+UInt32 KextRangeTable::lookup(const void* address) const
+{
+    Buffer* buffer = acquire();
+    const Range* range = find(buffer, address);
+    UInt32 loadTag = range ? range->loadTag : kUnknownClient;
+    release(buffer);
+    return loadTag;
+}
+
+UInt32 KextRangeTable::lookupClient(const void* caller, const void* callerCaller) const
+{
+    Buffer* buffer = acquire();
+    const Range* range = findClient(buffer, caller, callerCaller);
+    UInt32 loadTag = range ? range->loadTag : kUnknownClient;
+    release(buffer);
+    return loadTag;
+}
+
+bool KextRangeTable::contains(const void* caller, const void* callerCaller) const
+{
+    Buffer* buffer = acquire();
+    const Range* range = findClient(buffer, caller, callerCaller);
+    bool found = range && !range->transit;
+    release(buffer);
+    return found;
+}
+
+bool KextRangeTable::copyName(UInt32 loadTag, char* name, size_t size) const
+{
+    if (!mLock || loadTag == kUnknownClient)
+        return false;
+
+    // update() only rewrites the inactive buffer, and only under the lock
+    bool found = false;
+    IOLockLock(mLock);
+    const Buffer* buffer = mActive;
+    for (UInt32 i = 0; i < buffer->count; i++)
+    {
+        if (buffer->names[i].loadTag == loadTag)
+        {
+            strlcpy(name, buffer->names[i].name, size);
+            found = true;
+            break;
+        }
+    }
+    IOLockUnlock(mLock);
+    return found;
+}
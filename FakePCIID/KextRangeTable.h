@@ -0,0 +1,115 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef KextRangeTable_h
+#define KextRangeTable_h
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <libkern/OSKextLib.h>
+#include <libkern/c++/OSArray.h>
+#include <libkern/c++/OSDictionary.h>
+#include "PerCPU.h"
+
+// loaded kext info as kextstat gets it (libkern/OSKextLibPrivate.h)
+extern "C" OSDictionary* OSKextCopyLoadedKextInfo(OSArray* kextIdentifiers, OSArray* infoKeys);
+
+// Sorted table of loaded kext address ranges, used to map a return address
+// to the kext that made the call.
+//
+// The table is a snapshot taken by update() from OSKextCopyLoadedKextInfo,
+// which takes the kext lock and allocates, so it is never called from a
+// config access.  Lookups are lock free.  The table is double buffered:
+// update() rebuilds the inactive buffer and then publishes it.  A reader pins
+// the buffer it searches in its CPU's slot of mPins, so lookups on different
+// CPUs do not write a shared line, and update() does not rewrite a buffer
+// until the pins on it, summed over all CPUs, are gone, so a reader always sees a complete (if
+// possibly slightly stale) table.  Kext names are only read by copyName(),
+// under the update lock.
+//
+// With a list of bundle IDs, only those kexts (plus IOPCIFamily, to skip its
+// frames) are in the table, and contains() tells whether a call came from one
+// of them.
+
+class KextRangeTable
+{
+public:
+    enum { kUnknownClient = 0xFFFFFFFF };
+
+    bool init(OSArray* names = NULL);
+    void free();
+
+    // rebuild if the set of kexts changed (slow path, never from a config access)
+    bool update();
+
+    // returns loadTag of the kext containing address, or kUnknownClient
+    UInt32 lookup(const void* address) const;
+    // same, but skips over IOPCIFamily frames (configRead32(offset) -> configRead32(space, offset))
+    UInt32 lookupClient(const void* caller, const void* callerCaller) const;
+
+    // true if the call came from one of the kexts in the table (skipping IOPCIFamily)
+    bool contains(const void* caller, const void* callerCaller) const;
+
+    // bundle ID of loadTag as of the last update (takes the update lock)
+    bool copyName(UInt32 loadTag, char* name, size_t size) const;
+
+protected:
+    struct Range
+    {
+        UInt64 start;
+        UInt64 end;
+        UInt32 loadTag;
+        UInt32 transit;
+    };
+    struct Name
+    {
+        UInt32 loadTag;
+        char name[64];
+    };
+    struct Buffer
+    {
+        Range* ranges;
+        Name* names;                // same kexts as ranges, unsorted
+        UInt32 count;
+    };
+    struct Pins
+    {
+        volatile UInt32 readers[2];     // lookups in progress, per buffer
+    };
+
+    Buffer mBuffers[2];
+    Buffer* volatile mActive;
+    mutable PerCPU<Pins> mPins;
+    UInt32 mCapacity;
+    UInt32 mKextCount;          // kexts loaded at the last update
+    UInt32 mLatestLoadTag;      // and the highest load tag among them
+    IOLock* mLock;
+    OSArray* mNames;            // bundle IDs to include, NULL for all
+    OSArray* mIdentifiers;      // mNames plus IOPCIFamily and FakePCIID, NULL for all
+    OSArray* mInfoKeys;         // what update() asks OSKextCopyLoadedKextInfo for
+
+    Buffer* acquire() const;
+    void release(const Buffer* buffer) const;
+    UInt32 pinned(const Buffer* buffer) const;
+    static const Range* find(const Buffer* buffer, const void* address);
+    static const Range* findClient(const Buffer* buffer, const void* caller, const void* callerCaller);
+    bool isIncluded(const char* name) const;
+    static bool getKextInfo(OSObject* object, UInt64& address, UInt64& size, UInt32& loadTag);
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef OverrideBlob_h
+#define OverrideBlob_h
+
+// Packed override blob, produced offline by tools/injector_compiler from an
+// injector Info.plist and loaded by FakePCIID at hook time.
+//
+// The same blob is placed in every FakePCIID personality of the injector as
+// "FakeOverrides" <data>, along with "FakeOverridesRecord" <integer>, the
+// index of the record for that personality.
+//
+// Layout (all little endian, all offsets from start of blob):
+//
+//  OverrideBlobHeader
+//  OverrideBlobRecord[recordCount]
+//  OverrideBlobID[idCount]           unique match IDs, shared by all records
+//  uint16_t idRefs[idRefCount]       per-record slices of indices into IDs
+//  OverrideBlobWriteRule[ruleCount]
+
+#include <stdint.h>
+
+#define kOverrideBlobMagic      0x42495046  // 'FPIB'
+#define kOverrideBlobVersion    3
+
+// overlay covers the standard config header
+#define kOverrideBlobOverlaySize 64
+
+struct OverrideBlobHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t totalSize;
+    uint16_t recordCount;
+    uint16_t idCount;
+    uint16_t idRefCount;
+    uint16_t ruleCount;
+    uint32_t recordsOffset;
+    uint32_t idsOffset;
+    uint32_t idRefsOffset;
+    uint32_t rulesOffset;
+} __attribute__((packed));
+
+struct OverrideBlobRecord
+{
+    uint8_t overlay[kOverrideBlobOverlaySize];  // config header bytes presented to readers
+    uint64_t overlayMask;   // bit n set: overlay[n] replaces config byte n
+    uint64_t forcedMask;    // bit n set: from FakeProperties-Forced (overrides _DSM/FakeID)
+    uint16_t idRefFirst;    // slice of idRefs naming the IDs this record matches
+    uint16_t idRefCount;    // 0 if matched by class/name only
+    uint16_t ruleFirst;
+    uint16_t ruleCount;
+    uint16_t flags;         // kOverrideRecord*
+} __attribute__((packed));
+
+enum
+{
+    kOverrideRecordPassThrough = 0x01,  // FakeProperties also has keys not compiled into the blob
+};
+
+struct OverrideBlobID
+{
+    uint32_t id;            // device-id << 16 | vendor-id, as in IOPCIPrimaryMatch
+    uint32_t mask;
+} __attribute__((packed));
+
+enum
+{
+    kOverrideRuleBlock      = 0x01,     // drop writes to offset
+    kOverrideRuleInit       = 0x02,     // write force value at startup
+    kOverrideRuleHonorMask  = 0x04,     // take mask from the next register instead of mask
+    kOverrideRuleForced     = 0x08,     // from FakeProperties-Forced
+};
+
+// which of a rule's settings came from the injector; the others are left
+// to the driver's defaults
+enum
+{
+    kOverrideRulePresentForce   = 0x01,
+    kOverrideRulePresentMask    = 0x02,
+    kOverrideRulePresentInit    = 0x04,
+    kOverrideRulePresentBlock   = 0x08,
+    kOverrideRulePresentHonor   = 0x10,
+};
+
+struct OverrideBlobWriteRule
+{
+    uint8_t offset;
+    uint8_t flags;
+    uint16_t present;       // kOverrideRulePresent*
+    uint32_t mask;
+    uint32_t force;
+} __attribute__((packed));
+
+#endif
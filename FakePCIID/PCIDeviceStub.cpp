@@ -38,178 +38,130 @@ int PCIDeviceStub::getIntegerProperty(IORegistryEntry* entry, const char *aKey,
     return result;
 }
 
-UInt32 PCIDeviceStub::configRead32(IOPCIAddressSpace space, UInt8 offset)
+// From configReadCore/configWriteCore, the return address into the caller's
+// caller of the stub method (0 returns into the stub method, 1 into its
+// caller).  Used past IOPCIFamily's configRead32(offset) style wrappers, to
+// attribute an access to the kext that made it; only walked for when
+// FakeClients or a profile sample needs it.
+#define CallerCaller() __builtin_return_address(2)
+
+template <typename T>
+T PCIDeviceStub::configReadCore(IOPCIAddressSpace space, UInt8 offset, const void* caller)
 {
-    UInt32 result = super::configRead32(space, offset);
-    
-    UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
-   
-    DebugLog("[%04x:%04x] configRead32 address space(0x%08x, 0x%02x) result: 0x%08x\n",
-             deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, result);
-    
-    // Replace return value with injected vendor-id/device-id in ioreg
-    UInt32 newResult = result;
-    switch (offset)
-    {
-        case kIOPCIConfigVendorID:
-        case kIOPCIConfigDeviceID: // OS X does a non-aligned read, which still returns full vendor / device ID
-        {
-            int vendor = getIntegerProperty(this, "RM,vendor-id", "vendor-id");
-            if (-1 != vendor)
-                newResult = (newResult & 0xFFFF0000) | vendor;
-            
-            int device = getIntegerProperty(this, "RM,device-id", "device-id");
-            if (-1 != device)
-                newResult = (device << 16) | (newResult & 0xFFFF);
-            break;
-        }
-        case kIOPCIConfigSubSystemVendorID:
-        {
-            int vendor = getIntegerProperty(this, "RM,subsystem-vendor-id", "subsystem-vendor-id");
-            if (-1 != vendor)
-                newResult = (newResult & 0xFFFF0000) | vendor;
-            
-            int device = getIntegerProperty(this, "RM,subsystem-id", "subsystem-id");
-            if (-1 != device)
-                newResult = (device << 16) | (newResult & 0xFFFF);
-            break;
-        }
-        case kIOPCIConfigRevisionID:
-        {
-            int revision = getIntegerProperty(this, "RM,revision-id", "revision-id");
-            
-            if (-1 != revision)
-                newResult = (newResult & 0xFFFFFF00) | revision;
-            break;
-        }
-    }
-    
-    if (newResult != result)
-        DebugLog("[%04x:%04x] configRead32(0x%02x), result 0x%08x -> 0x%08x\n",
-                  deviceInfo & 0xFFFF, deviceInfo >> 16, offset, result, newResult);
+    FakePCIID* hook = FakePCIID::findHook(super::space);
+    UInt64 profile = hook ? hook->profileBegin() : 0;
+    const FakePCIID::Overrides* overrides = FakePCIID::findOverrides(space);
+    if (overrides && overrides->clients && !overrides->clients->contains(caller, CallerCaller()))
+        overrides = NULL;   // not a FakeClients kext, show the real IDs
 
-    return newResult;
-}
+    UInt32 direct;
+    T result = hook && hook->directRead(space, offset, sizeof(T), direct) ? direct : superConfigRead(space, offset, T());
 
-UInt16 PCIDeviceStub::configRead16(IOPCIAddressSpace space, UInt8 offset)
-{
-    UInt16 result = super::configRead16(space, offset);
-    
-    UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
-    
-    DebugLog("[%04x:%04x] configRead16 address space(0x%08x, 0x%02x) result: 0x%04x\n",
-             deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, result);
+#ifdef DEBUG
+    // for the log only: an extra IOPCIFamily read on every access
+    UInt32 deviceInfo = super::configRead32(space, kIOPCIConfigVendorID);
 
-    UInt16 newResult = result;
-    switch (offset)
-    {
-        case kIOPCIConfigVendorID:
-        {
-            int vendor = getIntegerProperty(this, "RM,vendor-id", "vendor-id");
-            if (-1 != vendor)
-                newResult = vendor;
-            break;
-        }
-        case kIOPCIConfigDeviceID:
-        {
-            int device = getIntegerProperty(this, "RM,device-id", "device-id");
-            if (-1 != device)
-                newResult = device;
-            break;
-        }
-        case kIOPCIConfigSubSystemVendorID:
-        {
-            int vendor = getIntegerProperty(this, "RM,subsystem-vendor-id", "subsystem-vendor-id");
-            if (-1 != vendor)
-                newResult = vendor;
-            break;
-        }
-        case kIOPCIConfigSubSystemID:
-        {
-            int device = getIntegerProperty(this, "RM,subsystem-id", "subsystem-id");
-            if (-1 != device)
-                newResult = device;
-            break;
-        }
-        case kIOPCIConfigRevisionID:
-        {
-            int revision = getIntegerProperty(this, "RM,revision-id", "revision-id");
-            
-            if (-1 != revision)
-                newResult = (newResult & 0xFF00) | revision;
-            break;
-        }
-    }
+    DebugLog("[%04x:%04x] configRead%d address space(0x%08x, 0x%02x) result: 0x%0*x\n",
+             deviceInfo & 0xFFFF, deviceInfo >> 16, (int)sizeof(T) * 8, space.bits, offset, (int)sizeof(T) * 2, result);
+#endif
+
+    // Replace overridden bytes covered by the read (eg. injected vendor-id/device-id in ioreg)
+    T newResult = overrides ? overlayConfigRead(result, offset, overrides->bytes, overrides->mask) : result;
+
+#ifdef DEBUG
+    if (hook && hook->injectFault(offset, sizeof(T)))
+        newResult = (T)~0;
 
     if (newResult != result)
-        DebugLog("[%04x:%04x] configRead16(0x%02x), result 0x%04x -> 0x%04x\n",
-                  deviceInfo & 0xFFFF, deviceInfo >> 16, offset, result, newResult);
+        DebugLog("[%04x:%04x] configRead%d(0x%02x), result 0x%0*x -> 0x%0*x\n",
+                 deviceInfo & 0xFFFF, deviceInfo >> 16, (int)sizeof(T) * 8, offset,
+                 (int)sizeof(T) * 2, result, (int)sizeof(T) * 2, newResult);
+#endif
+
+    if (profile)
+        hook->profileEnd(profile, caller, CallerCaller(), false);
 
     return newResult;
 }
 
+// also called by PCIDeviceStub_XHCIMux, which is built in another kext
+template UInt32 PCIDeviceStub::configReadCore<UInt32>(IOPCIAddressSpace, UInt8, const void*);
+template UInt16 PCIDeviceStub::configReadCore<UInt16>(IOPCIAddressSpace, UInt8, const void*);
+template UInt8 PCIDeviceStub::configReadCore<UInt8>(IOPCIAddressSpace, UInt8, const void*);
+
+UInt32 PCIDeviceStub::configRead32(IOPCIAddressSpace space, UInt8 offset)
+{
+    FakePCIID::InFlight inFlight;
+    return configReadCore<UInt32>(space, offset, __builtin_return_address(0));
+}
+
+UInt16 PCIDeviceStub::configRead16(IOPCIAddressSpace space, UInt8 offset)
+{
+    FakePCIID::InFlight inFlight;
+    return configReadCore<UInt16>(space, offset, __builtin_return_address(0));
+}
+
 UInt8 PCIDeviceStub::configRead8(IOPCIAddressSpace space, UInt8 offset)
 {
-    UInt8 result = super::configRead8(space, offset);
- 
+    FakePCIID::InFlight inFlight;
+    return configReadCore<UInt8>(space, offset, __builtin_return_address(0));
+}
+
+template <typename T>
+void PCIDeviceStub::configWriteCore(IOPCIAddressSpace space, UInt8 offset, T data, const void* caller)
+{
+    FakePCIID* hook = FakePCIID::findHook(super::space);
+    UInt64 profile = hook ? hook->profileBegin() : 0;
+
+#ifdef DEBUG
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
-    
-    DebugLog("[%04x:%04x] configRead8 address space(0x%08x, 0x%02x) result: 0x%02x\n",
-             deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, result);
-    
-    UInt8 newResult = result;
-    switch (offset)
-    {
-        case kIOPCIConfigRevisionID:
-        {
-            int revision = getIntegerProperty(this, "RM,revision-id", "revision-id");
-            
-            if (-1 != revision)
-                newResult = revision;
-            break;
-        }
-    }
-    
-    if (newResult != result)
-        DebugLog("[%04x:%04x] configRead8(0x%02x), result 0x%02x -> 0x%02x\n",
-                  deviceInfo & 0xFFFF, deviceInfo >> 16, offset, result, newResult);
-    
-    return newResult;
+
+    DebugLog("[%04x:%04x] configWrite%d address space(0x%08x, 0x%02x) data: 0x%0*x\n",
+             deviceInfo & 0xFFFF, deviceInfo >> 16, (int)sizeof(T) * 8, space.bits, offset, (int)sizeof(T) * 2, data);
+#endif
+
+    superConfigWrite(space, offset, data);
+
+    if (profile)
+        hook->profileEnd(profile, caller, CallerCaller(), true);
 }
 
-#ifdef HOOK_ALL
+template void PCIDeviceStub::configWriteCore<UInt32>(IOPCIAddressSpace, UInt8, UInt32, const void*);
+template void PCIDeviceStub::configWriteCore<UInt16>(IOPCIAddressSpace, UInt8, UInt16, const void*);
+template void PCIDeviceStub::configWriteCore<UInt8>(IOPCIAddressSpace, UInt8, UInt8, const void*);
+
 void PCIDeviceStub::configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32 data)
 {
-    UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
-    
-    DebugLog("[%04x:%04x] configWrite32 address space(0x%08x, 0x%02x) data: 0x%08x\n",
-             deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data);
-    
-    super::configWrite32(space, offset, data);
+    FakePCIID::InFlight inFlight;
+    configWriteCore<UInt32>(space, offset, data, __builtin_return_address(0));
 }
 
 void PCIDeviceStub::configWrite16(IOPCIAddressSpace space, UInt8 offset, UInt16 data)
 {
-    UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
-    
-    DebugLog("[%04x:%04x] configWrite16 address space(0x%08x, 0x%02x) data: 0x%04x\n",
-             deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data);
-    
-    super::configWrite16(space, offset, data);
+    FakePCIID::InFlight inFlight;
+    configWriteCore<UInt16>(space, offset, data, __builtin_return_address(0));
 }
 
 void PCIDeviceStub::configWrite8(IOPCIAddressSpace space, UInt8 offset, UInt8 data)
 {
-    UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
-    
-    DebugLog("[%04x:%04x] configWrite8 address space(0x%08x, 0x%02x) data: 0x%02x\n",
-             deviceInfo & 0xFFFF, deviceInfo >> 16, space.bits, offset, data);
-    
-    super::configWrite8(space, offset, data);
+    FakePCIID::InFlight inFlight;
+    configWriteCore<UInt8>(space, offset, data, __builtin_return_address(0));
 }
 
+bool PCIDeviceStub::attachToChild(IORegistryEntry* child, const IORegistryPlane* plane)
+{
+    FakePCIID::InFlight inFlight;
+    // a driver is attached just before its probe(), usually right after its
+    // kext was loaded, before the kext notifier has seen anything published
+    if (FakePCIID* hook = FakePCIID::getHook(this))
+        hook->updateKextTables();
+    return super::attachToChild(child, plane);
+}
+
+#ifdef HOOK_ALL
 UInt32 PCIDeviceStub::configRead32(UInt8 offset)
 {
+    FakePCIID::InFlight inFlight;
     UInt32 result = super::configRead32(offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -222,6 +174,7 @@ UInt32 PCIDeviceStub::configRead32(UInt8 offset)
 
 UInt16 PCIDeviceStub::configRead16(UInt8 offset)
 {
+    FakePCIID::InFlight inFlight;
     UInt16 result = super::configRead16(offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -234,6 +187,7 @@ UInt16 PCIDeviceStub::configRead16(UInt8 offset)
 
 UInt8 PCIDeviceStub::configRead8(UInt8 offset)
 {
+    FakePCIID::InFlight inFlight;
     UInt8 result = super::configRead8(offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -246,6 +200,7 @@ UInt8 PCIDeviceStub::configRead8(UInt8 offset)
 
 UInt32 PCIDeviceStub::extendedConfigRead32(IOByteCount offset)
 {
+    FakePCIID::InFlight inFlight;
     UInt32 result = super::extendedConfigRead32(offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -258,6 +213,7 @@ UInt32 PCIDeviceStub::extendedConfigRead32(IOByteCount offset)
 
 UInt16 PCIDeviceStub::extendedConfigRead16(IOByteCount offset)
 {
+    FakePCIID::InFlight inFlight;
     UInt16 result = super::extendedConfigRead16(offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -270,6 +226,7 @@ UInt16 PCIDeviceStub::extendedConfigRead16(IOByteCount offset)
 
 UInt8 PCIDeviceStub::extendedConfigRead8(IOByteCount offset)
 {
+    FakePCIID::InFlight inFlight;
     UInt8 result = super::extendedConfigRead8(offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -282,6 +239,7 @@ UInt8 PCIDeviceStub::extendedConfigRead8(IOByteCount offset)
 
 UInt32 PCIDeviceStub::ioRead32(UInt16 offset, IOMemoryMap* map)
 {
+    FakePCIID::InFlight inFlight;
     UInt32 result = super::ioRead32(offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -294,6 +252,7 @@ UInt32 PCIDeviceStub::ioRead32(UInt16 offset, IOMemoryMap* map)
 
 UInt16 PCIDeviceStub::ioRead16(UInt16 offset, IOMemoryMap* map)
 {
+    FakePCIID::InFlight inFlight;
     UInt16 result = super::ioRead16(offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -306,6 +265,7 @@ UInt16 PCIDeviceStub::ioRead16(UInt16 offset, IOMemoryMap* map)
 
 UInt8 PCIDeviceStub::ioRead8(UInt16 offset, IOMemoryMap* map)
 {
+    FakePCIID::InFlight inFlight;
     UInt8 result = super::ioRead8(offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -318,6 +278,7 @@ UInt8 PCIDeviceStub::ioRead8(UInt16 offset, IOMemoryMap* map)
 
 IODeviceMemory* PCIDeviceStub::getDeviceMemoryWithRegister( UInt8 reg )
 {
+    FakePCIID::InFlight inFlight;
     IODeviceMemory* result = super::getDeviceMemoryWithRegister(reg);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -331,6 +292,7 @@ IODeviceMemory* PCIDeviceStub::getDeviceMemoryWithRegister( UInt8 reg )
 
 IOMemoryMap* PCIDeviceStub::mapDeviceMemoryWithRegister(UInt8 reg, IOOptionBits options)
 {
+    FakePCIID::InFlight inFlight;
     IOMemoryMap* result = super::mapDeviceMemoryWithRegister(reg, options);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -344,6 +306,7 @@ IOMemoryMap* PCIDeviceStub::mapDeviceMemoryWithRegister(UInt8 reg, IOOptionBits
 
 IODeviceMemory* PCIDeviceStub::ioDeviceMemory(void)
 {
+    FakePCIID::InFlight inFlight;
     IODeviceMemory* result = super::ioDeviceMemory();
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
@@ -357,6 +320,7 @@ IODeviceMemory* PCIDeviceStub::ioDeviceMemory(void)
 
 UInt32 PCIDeviceStub::extendedFindPCICapability( UInt32 capabilityID, IOByteCount* offset)
 {
+    FakePCIID::InFlight inFlight;
     UInt32 result = super::extendedFindPCICapability(capabilityID, offset);
     
     UInt32 deviceInfo = super::configRead32(super::space, kIOPCIConfigVendorID);
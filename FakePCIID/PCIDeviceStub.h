@@ -77,18 +77,44 @@ class PCIDeviceStub : public IOPCIDevice
     typedef IOPCIDevice super;
 
 protected:
-    static int getIntegerProperty(IORegistryEntry* entry, const char* aKey, const char* alternateKey);
-    
+    // shared by configRead32/16/8; T is the access width.  caller is the
+    // return address of the stub method; the core is called directly from
+    // that method and never inlined, so it can find the caller's caller
+    // (see CallerCaller) when it needs it
+    template <typename T>
+    __attribute__((noinline)) T configReadCore(IOPCIAddressSpace space, UInt8 offset, const void* caller);
+
+    inline UInt32 superConfigRead(IOPCIAddressSpace space, UInt8 offset, UInt32)
+        { return super::configRead32(space, offset); }
+    inline UInt16 superConfigRead(IOPCIAddressSpace space, UInt8 offset, UInt16)
+        { return super::configRead16(space, offset); }
+    inline UInt8 superConfigRead(IOPCIAddressSpace space, UInt8 offset, UInt8)
+        { return super::configRead8(space, offset); }
+
+    // shared by configWrite32/16/8: passthrough, profiled; called as configReadCore
+    template <typename T>
+    __attribute__((noinline)) void configWriteCore(IOPCIAddressSpace space, UInt8 offset, T data, const void* caller);
+
+    inline void superConfigWrite(IOPCIAddressSpace space, UInt8 offset, UInt32 data)
+        { super::configWrite32(space, offset, data); }
+    inline void superConfigWrite(IOPCIAddressSpace space, UInt8 offset, UInt16 data)
+        { super::configWrite16(space, offset, data); }
+    inline void superConfigWrite(IOPCIAddressSpace space, UInt8 offset, UInt8 data)
+        { super::configWrite8(space, offset, data); }
+
 public:
+    static int getIntegerProperty(IORegistryEntry* entry, const char* aKey, const char* alternateKey);
+
     virtual UInt32 configRead32(IOPCIAddressSpace space, UInt8 offset);
     virtual UInt16 configRead16(IOPCIAddressSpace space, UInt8 offset);
     virtual UInt8 configRead8(IOPCIAddressSpace space, UInt8 offset);
-
-#ifdef HOOK_ALL
     virtual void configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32 data);
     virtual void configWrite16(IOPCIAddressSpace space, UInt8 offset, UInt16 data);
     virtual void configWrite8(IOPCIAddressSpace space, UInt8 offset, UInt8 data);
-    
+
+    virtual bool attachToChild(IORegistryEntry* child, const IORegistryPlane* plane);
+
+#ifdef HOOK_ALL
     virtual UInt32 configRead32(UInt8 offset);
     virtual UInt16 configRead16(UInt8 offset);
     virtual UInt8 configRead8(UInt8 offset);
@@ -108,4 +134,12 @@ public:
 #endif
 };
 
+// instantiated in PCIDeviceStub.cpp
+extern template UInt32 PCIDeviceStub::configReadCore<UInt32>(IOPCIAddressSpace, UInt8, const void*);
+extern template UInt16 PCIDeviceStub::configReadCore<UInt16>(IOPCIAddressSpace, UInt8, const void*);
+extern template UInt8 PCIDeviceStub::configReadCore<UInt8>(IOPCIAddressSpace, UInt8, const void*);
+extern template void PCIDeviceStub::configWriteCore<UInt32>(IOPCIAddressSpace, UInt8, UInt32, const void*);
+extern template void PCIDeviceStub::configWriteCore<UInt16>(IOPCIAddressSpace, UInt8, UInt16, const void*);
+extern template void PCIDeviceStub::configWriteCore<UInt8>(IOPCIAddressSpace, UInt8, UInt8, const void*);
+
 #endif
@@ -0,0 +1,71 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef PerCPU_h
+#define PerCPU_h
+
+#include <IOKit/IOLib.h>
+#include <kern/cpu_number.h>
+
+// Write-hot per-device data (counters) lives in one cache line aligned slot
+// per CPU, so config accesses on different CPUs never write the same line.
+// Read-mostly data (overrides, policy) stays in the FakePCIID object.
+//
+// Threads may be preempted and migrate between local() and the update, so
+// updates still use atomics; they are just uncontended.  Readers sum all
+// slots.
+
+#define kPerCPUCacheLine 64
+#define kPerCPUMaxCPUs   64
+
+template <typename T>
+class PerCPU
+{
+public:
+    enum { kMaxCPUs = kPerCPUMaxCPUs };
+
+    bool init()
+    {
+        mSlots = (Slot*)IOMallocAligned(sizeof(Slot) * kMaxCPUs, kPerCPUCacheLine);
+        if (!mSlots)
+            return false;
+        bzero(mSlots, sizeof(Slot) * kMaxCPUs);
+        return true;
+    }
+
+    void free()
+    {
+        if (mSlots)
+            IOFreeAligned(mSlots, sizeof(Slot) * kMaxCPUs);
+        mSlots = NULL;
+    }
+
+    inline bool isValid() const { return mSlots != NULL; }
+    inline T& local() { return mSlots[cpu_number() & (kMaxCPUs - 1)].value; }
+    inline const T& operator[](int cpu) const { return mSlots[cpu].value; }
+
+private:
+    struct Slot
+    {
+        T value;
+    } __attribute__((aligned(kPerCPUCacheLine)));
+
+    Slot* mSlots;
+};
+
+#endif
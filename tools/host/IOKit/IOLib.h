@@ -0,0 +1,52 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// Host stand-in for the parts of <IOKit/IOLib.h> used by the FakePCIID
+// headers that the tools/ programs build (PerCPU.h).
+
+#ifndef HostIOLib_h
+#define HostIOLib_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int32_t SInt32;
+typedef int64_t SInt64;
+
+static inline void* IOMallocAligned(size_t size, size_t alignment)
+{
+    void* p = NULL;
+    return posix_memalign(&p, alignment, size) ? NULL : p;
+}
+
+static inline void IOFreeAligned(void* p, size_t size)
+{
+    (void)size;
+    free(p);
+}
+
+static inline SInt32 OSIncrementAtomic(volatile UInt32* p) { return __sync_fetch_and_add(p, 1); }
+static inline SInt32 OSDecrementAtomic(volatile UInt32* p) { return __sync_fetch_and_sub(p, 1); }
+static inline SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64* p) { return __sync_fetch_and_add(p, amount); }
+
+#endif
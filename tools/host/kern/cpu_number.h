@@ -0,0 +1,46 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// Host stand-in for <kern/cpu_number.h>.  On Linux this is the CPU the
+// thread is running on, as in the kernel.  Elsewhere each thread gets its
+// own number on first use, which is what cpu_number() amounts to for a
+// thread that is never migrated.
+
+#ifndef HostCPUNumber_h
+#define HostCPUNumber_h
+
+#ifdef __linux__
+#include <sched.h>
+
+static inline int cpu_number()
+{
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu;
+}
+#else
+static inline int cpu_number()
+{
+    static volatile int next;
+    static __thread int cpu = -1;
+    if (cpu < 0)
+        cpu = __sync_fetch_and_add(&next, 1);
+    return cpu;
+}
+#endif
+
+#endif
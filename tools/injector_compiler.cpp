@@ -0,0 +1,978 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// injector_compiler: validates a FakePCIID injector Info.plist and compiles
+// the FakeProperties of its FakePCIID personalities into a packed
+// FakeOverrides blob (see FakePCIID/OverrideBlob.h).
+//
+// Builds with any host C++ compiler (no CoreFoundation), so injectors can be
+// checked on Linux as well as OS X.
+//
+// usage: injector_compiler [-c] [-o output.plist] [-b output.bin] injector.plist
+//   -c  check only
+//   -o  write injector with FakeOverrides added to each FakePCIID personality
+//   -b  write raw blob
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "../FakePCIID/OverrideBlob.h"
+
+using std::string;
+using std::vector;
+
+static const char* gFileName = "";
+static int gErrors = 0;
+
+static void error(const char* context, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static void error(const char* context, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s: error: %s%s", gFileName, context, *context ? ": " : "");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    gErrors++;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// minimal XML plist reader
+
+typedef std::pair<size_t, size_t> Span;    // [first, second) in source
+
+struct Node
+{
+    enum Type { kDict, kArray, kString, kData, kInteger, kBool } type;
+    string text;                        // string/integer value, decoded data bytes
+    bool boolValue;
+    vector<string> keys;                // dict only, parallel to children
+    vector<Node*> children;
+    vector<Span> spans;                 // dict only, parallel to children: <key> through value in source
+    size_t closeOffset;                 // dict only: offset of "</dict>" in source
+
+    Node(Type t) : type(t), boolValue(false), closeOffset(0) {}
+    ~Node() { for (size_t i = 0; i < children.size(); i++) delete children[i]; }
+
+    const Node* get(const char* key) const
+    {
+        int i = find(key);
+        return i < 0 ? NULL : children[i];
+    }
+
+    int find(const char* key) const
+    {
+        for (size_t i = 0; i < keys.size(); i++)
+            if (keys[i] == key)
+                return i;
+        return -1;
+    }
+};
+
+class PlistReader
+{
+public:
+    PlistReader(const string& source) : mSource(source), mPos(0) {}
+
+    Node* parse()
+    {
+        skipProlog();
+        if (!expectTag("plist"))
+            return NULL;
+        Node* root = parseValue();
+        if (root && !expectTag("/plist"))
+        {
+            delete root;
+            return NULL;
+        }
+        return root;
+    }
+
+private:
+    const string& mSource;
+    size_t mPos;
+
+    int line() const
+    {
+        int n = 1;
+        for (size_t i = 0; i < mPos && i < mSource.size(); i++)
+            n += mSource[i] == '\n';
+        return n;
+    }
+
+    void fail(const char* what)
+    {
+        char context[32];
+        snprintf(context, sizeof(context), "line %d", line());
+        error(context, "%s", what);
+    }
+
+    void skipSpace()
+    {
+        for (;;)
+        {
+            while (mPos < mSource.size() && strchr(" \t\r\n", mSource[mPos]))
+                mPos++;
+            if (mSource.compare(mPos, 4, "<!--") == 0)
+            {
+                size_t end = mSource.find("-->", mPos);
+                mPos = end == string::npos ? mSource.size() : end + 3;
+                continue;
+            }
+            break;
+        }
+    }
+
+    void skipProlog()
+    {
+        for (;;)
+        {
+            skipSpace();
+            if (mSource.compare(mPos, 2, "<?") == 0 || mSource.compare(mPos, 2, "<!") == 0)
+            {
+                size_t end = mSource.find('>', mPos);
+                mPos = end == string::npos ? mSource.size() : end + 1;
+                continue;
+            }
+            break;
+        }
+    }
+
+    // reads "<name ...>" or "<name/>"; returns tag name, sets empty for "/>"
+    bool readTag(string& name, bool& empty)
+    {
+        skipSpace();
+        if (mPos >= mSource.size() || mSource[mPos] != '<')
+        {
+            fail("expected tag");
+            return false;
+        }
+        size_t end = mSource.find('>', mPos);
+        if (end == string::npos)
+        {
+            fail("unterminated tag");
+            return false;
+        }
+        string tag = mSource.substr(mPos + 1, end - mPos - 1);
+        empty = !tag.empty() && tag[tag.size() - 1] == '/';
+        if (empty)
+            tag.erase(tag.size() - 1);
+        name = tag.substr(0, tag.find_first_of(" \t\r\n"));
+        mPos = end + 1;
+        return true;
+    }
+
+    bool expectTag(const char* expected)
+    {
+        string name;
+        bool empty;
+        if (!readTag(name, empty))
+            return false;
+        if (name != expected)
+        {
+            string what = "expected <" + string(expected) + ">, found <" + name + ">";
+            fail(what.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool readText(const char* closing, string& text)
+    {
+        size_t end = mSource.find(string("</") + closing + ">", mPos);
+        if (end == string::npos)
+        {
+            fail("unterminated element");
+            return false;
+        }
+        text = unescape(mSource.substr(mPos, end - mPos));
+        mPos = end + strlen(closing) + 3;
+        return true;
+    }
+
+    static string unescape(const string& s)
+    {
+        static const struct { const char* entity; char ch; } entities[] =
+            { { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' }, { "&apos;", '\'' } };
+        string result;
+        for (size_t i = 0; i < s.size(); i++)
+        {
+            size_t j;
+            for (j = 0; j < sizeof(entities)/sizeof(entities[0]); j++)
+            {
+                size_t len = strlen(entities[j].entity);
+                if (s.compare(i, len, entities[j].entity) == 0)
+                {
+                    result += entities[j].ch;
+                    i += len - 1;
+                    break;
+                }
+            }
+            if (j == sizeof(entities)/sizeof(entities[0]))
+                result += s[i];
+        }
+        return result;
+    }
+
+    static bool base64Decode(const string& in, string& out)
+    {
+        int bits = 0, count = 0;
+        for (size_t i = 0; i < in.size(); i++)
+        {
+            char c = in[i];
+            int v;
+            if (c >= 'A' && c <= 'Z') v = c - 'A';
+            else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+            else if (c >= '0' && c <= '9') v = c - '0' + 52;
+            else if (c == '+') v = 62;
+            else if (c == '/') v = 63;
+            else if (c == '=' || strchr(" \t\r\n", c)) continue;
+            else return false;
+            bits = (bits << 6) | v;
+            if (++count == 4)
+            {
+                out += (char)(bits >> 16);
+                out += (char)(bits >> 8);
+                out += (char)bits;
+                bits = count = 0;
+            }
+        }
+        if (count == 1)
+            return false;
+        if (count == 2)
+            out += (char)(bits >> 4);
+        if (count == 3)
+        {
+            out += (char)(bits >> 10);
+            out += (char)(bits >> 2);
+        }
+        return true;
+    }
+
+    Node* parseValue()
+    {
+        string name;
+        bool empty;
+        if (!readTag(name, empty))
+            return NULL;
+
+        if (name == "dict")
+        {
+            Node* node = new Node(Node::kDict);
+            while (!empty)
+            {
+                skipSpace();
+                size_t start = mPos;
+                string key;
+                bool keyEmpty;
+                if (!readTag(key, keyEmpty))
+                    break;
+                if (key == "/dict")
+                {
+                    node->closeOffset = start;
+                    return node;
+                }
+                string keyText;
+                if (key != "key" || keyEmpty || !readText("key", keyText))
+                {
+                    fail("expected <key> in <dict>");
+                    break;
+                }
+                Node* value = parseValue();
+                if (!value)
+                    break;
+                node->keys.push_back(keyText);
+                node->children.push_back(value);
+                node->spans.push_back(Span(start, mPos));
+            }
+            if (empty)
+            {
+                node->closeOffset = string::npos;
+                return node;
+            }
+            delete node;
+            return NULL;
+        }
+        if (name == "array")
+        {
+            Node* node = new Node(Node::kArray);
+            while (!empty)
+            {
+                skipSpace();
+                if (mSource.compare(mPos, 8, "</array>") == 0)
+                {
+                    mPos += 8;
+                    return node;
+                }
+                Node* value = parseValue();
+                if (!value)
+                {
+                    delete node;
+                    return NULL;
+                }
+                node->children.push_back(value);
+            }
+            return node;
+        }
+        if (name == "string" || name == "integer" || name == "data")
+        {
+            Node* node = new Node(name == "string" ? Node::kString : name == "integer" ? Node::kInteger : Node::kData);
+            string text;
+            if (!empty && !readText(name.c_str(), text))
+            {
+                delete node;
+                return NULL;
+            }
+            if (node->type == Node::kData)
+            {
+                if (!base64Decode(text, node->text))
+                {
+                    fail("invalid base64 in <data>");
+                    delete node;
+                    return NULL;
+                }
+            }
+            else
+                node->text = text;
+            return node;
+        }
+        if ((name == "true" || name == "false") && empty)
+        {
+            Node* node = new Node(Node::kBool);
+            node->boolValue = name == "true";
+            return node;
+        }
+        string what = "unsupported element <" + name + ">";
+        fail(what.c_str());
+        return NULL;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// compiler
+
+struct IDEntry
+{
+    uint32_t id, mask;
+    bool operator<(const IDEntry& other) const
+        { return id != other.id ? id < other.id : mask < other.mask; }
+};
+
+class Compiler
+{
+public:
+    struct Personality
+    {
+        string name;
+        const Node* dict;
+        uint16_t record;
+        vector<Span> strip;     // compiled FakeProperties entries, left out of the output
+    };
+
+    vector<Personality> mPersonalities;
+
+    bool compile(const Node* root)
+    {
+        const Node* personalities = root->type == Node::kDict ? root->get("IOKitPersonalities") : NULL;
+        if (!personalities || personalities->type != Node::kDict)
+        {
+            error("", "missing IOKitPersonalities dictionary");
+            return false;
+        }
+        for (size_t i = 0; i < personalities->keys.size(); i++)
+        {
+            const Node* dict = personalities->children[i];
+            const string& name = personalities->keys[i];
+            if (dict->type != Node::kDict)
+            {
+                error(name.c_str(), "personality is not a dictionary");
+                continue;
+            }
+            const Node* ioClass = dict->get("IOClass");
+            if (!ioClass || ioClass->type != Node::kString)
+            {
+                error(name.c_str(), "missing IOClass");
+                continue;
+            }
+            // other personalities (eg. Apple drivers matched by the injector) are left alone
+            if (ioClass->text != "FakePCIID" && ioClass->text != "FakePCIID_XHCIMux")
+                continue;
+            if (dict->get("FakeOverrides"))
+            {
+                error(name.c_str(), "already contains FakeOverrides");
+                continue;
+            }
+            compilePersonality(name, dict, ioClass->text == "FakePCIID_XHCIMux");
+        }
+        return gErrors == 0;
+    }
+
+    string blob() const
+    {
+        OverrideBlobHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = kOverrideBlobMagic;
+        header.version = kOverrideBlobVersion;
+        header.headerSize = sizeof(header);
+        header.recordCount = mRecords.size();
+        header.idCount = mIDs.size();
+        header.idRefCount = mIDRefs.size();
+        header.ruleCount = mRules.size();
+        header.recordsOffset = sizeof(header);
+        header.idsOffset = header.recordsOffset + mRecords.size() * sizeof(OverrideBlobRecord);
+        header.idRefsOffset = header.idsOffset + mIDs.size() * sizeof(OverrideBlobID);
+        header.rulesOffset = header.idRefsOffset + ((mIDRefs.size() * sizeof(uint16_t) + 3) & ~3);
+        header.totalSize = header.rulesOffset + mRules.size() * sizeof(OverrideBlobWriteRule);
+
+        string out((const char*)&header, sizeof(header));
+        out.append((const char*)mRecords.data(), mRecords.size() * sizeof(OverrideBlobRecord));
+        out.append((const char*)mIDs.data(), mIDs.size() * sizeof(OverrideBlobID));
+        out.append((const char*)mIDRefs.data(), mIDRefs.size() * sizeof(uint16_t));
+        out.resize(header.rulesOffset);
+        out.append((const char*)mRules.data(), mRules.size() * sizeof(OverrideBlobWriteRule));
+        return out;
+    }
+
+private:
+    vector<OverrideBlobRecord> mRecords;
+    vector<OverrideBlobID> mIDs;
+    std::map<IDEntry, uint16_t> mIDIndex;
+    vector<uint16_t> mIDRefs;
+    vector<OverrideBlobWriteRule> mRules;
+
+    uint16_t addID(uint32_t id, uint32_t mask)
+    {
+        IDEntry entry = { id & mask, mask };
+        std::map<IDEntry, uint16_t>::iterator it = mIDIndex.find(entry);
+        if (it != mIDIndex.end())
+            return it->second;
+        OverrideBlobID blobID = { entry.id, entry.mask };
+        mIDs.push_back(blobID);
+        return mIDIndex[entry] = mIDs.size() - 1;
+    }
+
+    static bool parseHex(const string& s, uint32_t& value)
+    {
+        char* end;
+        const char* str = s.c_str();
+        if (strncmp(str, "0x", 2) && strncmp(str, "0X", 2))
+            return false;
+        unsigned long v = strtoul(str + 2, &end, 16);
+        if (end == str + 2 || *end || v > 0xFFFFFFFFUL)
+            return false;
+        value = v;
+        return true;
+    }
+
+    // IOPCIPrimaryMatch/IOPCIMatch: "0xDDDDVVVV[&0xMMMMMMMM] ..."
+    void addPrimaryMatch(const char* context, const string& match, vector<uint16_t>& refs)
+    {
+        size_t pos = 0;
+        while (pos < match.size())
+        {
+            size_t start = match.find_first_not_of(" \t\r\n", pos);
+            if (start == string::npos)
+                break;
+            size_t end = match.find_first_of(" \t\r\n", start);
+            string token = match.substr(start, end == string::npos ? string::npos : end - start);
+            pos = end == string::npos ? match.size() : end;
+
+            uint32_t id, mask = 0xFFFFFFFF;
+            size_t amp = token.find('&');
+            if (!parseHex(token.substr(0, amp), id) || (amp != string::npos && !parseHex(token.substr(amp + 1), mask)))
+            {
+                error(context, "invalid PCI match \"%s\"", token.c_str());
+                continue;
+            }
+            refs.push_back(addID(id, mask));
+        }
+    }
+
+    // IONameMatch: "pciVVVV,DDDD" (other names do not identify a device)
+    void addNameMatch(const char* context, const Node* node, vector<uint16_t>& refs)
+    {
+        if (node->type == Node::kArray)
+        {
+            for (size_t i = 0; i < node->children.size(); i++)
+                addNameMatch(context, node->children[i], refs);
+            return;
+        }
+        if (node->type != Node::kString)
+        {
+            error(context, "IONameMatch must be a string or array of strings");
+            return;
+        }
+        unsigned vendor, device;
+        char extra;
+        if (sscanf(node->text.c_str(), "pci%x,%x%c", &vendor, &device, &extra) == 2)
+        {
+            if (vendor > 0xFFFF || device > 0xFFFF)
+                error(context, "invalid IONameMatch \"%s\"", node->text.c_str());
+            else
+                refs.push_back(addID(device << 16 | vendor, 0xFFFFFFFF));
+        }
+    }
+
+    struct Field { const char* key; uint8_t offset; uint8_t size; uint32_t max; };
+
+    static const Field* findField(const string& key)
+    {
+        static const Field fields[] =
+        {
+            { "RM,vendor-id", 0x00, 2, 0xFFFF },
+            { "RM,device-id", 0x02, 2, 0xFFFF },
+            { "RM,revision-id", 0x08, 1, 0xFF },
+            { "RM,subsystem-vendor-id", 0x2C, 2, 0xFFFF },
+            { "RM,subsystem-id", 0x2E, 2, 0xFFFF },
+        };
+        for (size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); i++)
+            if (key == fields[i].key)
+                return &fields[i];
+        return NULL;
+    }
+
+    // provider properties read by FakePCIID itself (RM,fault-* only in debug
+    // builds); not compiled, but passed through like any other property
+    static bool isProviderProperty(const string& key)
+    {
+        static const char* keys[] =
+        {
+            "RM,profile-rate",
+            "RM,fault-percent", "RM,fault-offset-first", "RM,fault-offset-last",
+            "RM,fault-widths", "RM,fault-delay", "RM,fault-absent",
+        };
+        for (size_t i = 0; i < sizeof(keys)/sizeof(keys[0]); i++)
+            if (key == keys[i])
+                return true;
+        return false;
+    }
+
+    static uint32_t dataValue(const Node* node)
+    {
+        uint32_t value = 0;
+        for (size_t i = 0; i < node->text.size() && i < 4; i++)
+            value |= (uint32_t)(uint8_t)node->text[i] << (8 * i);
+        return value;
+    }
+
+    // XHCIMux registers, as in FakePCIID_XHCIMux.h
+    struct MuxRegister
+    {
+        const char* prefix;         // common prefix of the keys below
+        uint8_t offset, maskOffset;
+        const char* force;
+        const char* init;
+        const char* block;
+        const char* maskBlock;
+        const char* honorMask;
+        const char* chipsetMask;
+    };
+
+    struct MuxSettings
+    {
+        bool present, forced, mixed;
+        uint16_t rulePresent;       // kOverrideRulePresent* for the register's own settings
+        uint32_t force, mask;
+        bool init, block, honor, maskBlock, maskBlockPresent;
+    };
+
+    enum { kMuxRegisterCount = 2 };
+    static const MuxRegister* muxRegisters()
+    {
+        static const MuxRegister registers[kMuxRegisterCount] =
+        {
+            { "RM,pr2", 0xd0, 0xd4, "RM,pr2-force", "RM,pr2-init", "RM,pr2-block",
+              "RM,pr2m-block", "RM,pr2-honor-pr2m", "RM,pr2-chipset-mask" },
+            { "RM,pssen", 0xd8, 0xdc, "RM,pssen-force", "RM,pssen-init", "RM,pssen-block",
+              "RM,usb3prm-block", "RM,pssen-honor-usb3prm", "RM,pssen-chipset-mask" },
+        };
+        return registers;
+    }
+
+    static int findMuxRegister(const string& key)
+    {
+        const MuxRegister* registers = muxRegisters();
+        for (int i = 0; i < kMuxRegisterCount; i++)
+        {
+            const MuxRegister& reg = registers[i];
+            if (key == reg.force || key == reg.init || key == reg.block ||
+                key == reg.maskBlock || key == reg.honorMask || key == reg.chipsetMask)
+                return i;
+        }
+        return -1;
+    }
+
+    // adds the spans of the keys compiled into record/mux to strip
+    void compileProperties(const string& name, const Node* props, bool forced, bool xhciMux,
+                           OverrideBlobRecord& record, MuxSettings* mux, vector<Span>& strip)
+    {
+        string context = name + (forced ? " FakeProperties-Forced" : " FakeProperties");
+        if (props->type != Node::kDict)
+        {
+            error(context.c_str(), "must be a dictionary");
+            return;
+        }
+        for (size_t i = 0; i < props->keys.size(); i++)
+        {
+            const string& key = props->keys[i];
+            const Node* value = props->children[i];
+            string keyContext = context + " " + key;
+            if (value->type != Node::kData)
+            {
+                error(keyContext.c_str(), "value must be <data>");
+                continue;
+            }
+            if (const Field* field = findField(key))
+            {
+                uint32_t v = dataValue(value);
+                if (value->text.size() != 4 || v > field->max)
+                {
+                    error(keyContext.c_str(), "must be 4 bytes with value <= 0x%x", field->max);
+                    continue;
+                }
+                for (int b = 0; b < field->size; b++)
+                {
+                    uint64_t bit = 1ULL << (field->offset + b);
+                    // forced wins, as FakeProperties-Forced is merged last
+                    if ((record.forcedMask & bit) && !forced)
+                        continue;
+                    record.overlay[field->offset + b] = v >> (8 * b);
+                    record.overlayMask |= bit;
+                    if (forced)
+                        record.forcedMask |= bit;
+                }
+                strip.push_back(props->spans[i]);
+                continue;
+            }
+            if (key == "vendor-id" || key == "device-id" || key == "revision-id" ||
+                key == "subsystem-vendor-id" || key == "subsystem-id")
+            {
+                error(keyContext.c_str(), "use RM,%s in injectors", key.c_str());
+                continue;
+            }
+            if (xhciMux && (key.compare(0, 6, "RM,pr2") == 0 || key.compare(0, 8, "RM,pssen") == 0 ||
+                            key.compare(0, 10, "RM,usb3prm") == 0))
+            {
+                int index = findMuxRegister(key);
+                if (index < 0)
+                {
+                    error(keyContext.c_str(), "unknown XHCIMux property");
+                    continue;
+                }
+                const MuxRegister& reg = muxRegisters()[index];
+                MuxSettings& settings = mux[index];
+                bool isMask = key == reg.force || key == reg.chipsetMask;
+                if (value->text.size() != (isMask ? 4u : 1u))
+                {
+                    error(keyContext.c_str(), "must be %d byte(s)", isMask ? 4 : 1);
+                    continue;
+                }
+                if (settings.present && settings.forced != forced)
+                    settings.mixed = true;
+                settings.present = true;
+                settings.forced = forced;
+                uint32_t v = dataValue(value);
+                if (key == reg.force) { settings.force = v; settings.rulePresent |= kOverrideRulePresentForce; }
+                else if (key == reg.chipsetMask) { settings.mask = v; settings.rulePresent |= kOverrideRulePresentMask; }
+                else if (key == reg.init) { settings.init = v != 0; settings.rulePresent |= kOverrideRulePresentInit; }
+                else if (key == reg.block) { settings.block = v != 0; settings.rulePresent |= kOverrideRulePresentBlock; }
+                else if (key == reg.honorMask) { settings.honor = v != 0; settings.rulePresent |= kOverrideRulePresentHonor; }
+                else { settings.maskBlock = v != 0; settings.maskBlockPresent = true; }
+                strip.push_back(props->spans[i]);
+                continue;
+            }
+            if (isProviderProperty(key) || key.compare(0, 9, "RM,fault-") == 0)
+            {
+                // FakePCIID ignores any other size without a word
+                if (!isProviderProperty(key))
+                    error(keyContext.c_str(), "unknown fault injection property");
+                else if (value->text.size() != 4)
+                    error(keyContext.c_str(), "must be 4 bytes");
+                record.flags |= kOverrideRecordPassThrough;
+                continue;
+            }
+            // anything else is for the provider (or its driver) as is, so the
+            // kext merges the FakeProperties dictionaries as well
+            record.flags |= kOverrideRecordPassThrough;
+        }
+    }
+
+    void compilePersonality(const string& name, const Node* dict, bool xhciMux)
+    {
+        const char* context = name.c_str();
+        const Node* provider = dict->get("IOProviderClass");
+        if (!provider || provider->type != Node::kString || provider->text != "IOPCIDevice")
+            error(context, "IOProviderClass must be IOPCIDevice");
+
+        vector<uint16_t> refs;
+        bool matched = false;
+        static const char* pciMatches[] = { "IOPCIPrimaryMatch", "IOPCIMatch", "IOPCISecondaryMatch" };
+        for (size_t i = 0; i < sizeof(pciMatches)/sizeof(pciMatches[0]); i++)
+        {
+            if (const Node* match = dict->get(pciMatches[i]))
+            {
+                matched = true;
+                if (match->type != Node::kString)
+                    error(context, "%s must be a string", pciMatches[i]);
+                else if (i != 2)    // secondary match is subsystem IDs, not the device itself
+                    addPrimaryMatch(context, match->text, refs);
+            }
+        }
+        if (const Node* match = dict->get("IONameMatch"))
+        {
+            matched = true;
+            addNameMatch(context, match, refs);
+        }
+        if (const Node* match = dict->get("IOPCIClassMatch"))
+        {
+            matched = true;
+            if (match->type != Node::kString)
+                error(context, "IOPCIClassMatch must be a string");
+        }
+        if (!matched)
+            error(context, "no PCI matching keys");
+
+        OverrideBlobRecord record;
+        memset(&record, 0, sizeof(record));
+        // defaults as in FakePCIID_XHCIMux
+        MuxSettings mux[kMuxRegisterCount];
+        for (int i = 0; i < kMuxRegisterCount; i++)
+        {
+            MuxSettings defaults = { false, false, false, 0, 0, 0, true, false, true, false, false };
+            mux[i] = defaults;
+        }
+
+        const Node* props = dict->get("FakeProperties");
+        const Node* forcedProps = dict->get("FakeProperties-Forced");
+        if (!props && !forcedProps)
+            error(context, "no FakeProperties or FakeProperties-Forced");
+        vector<Span> strip;
+        static const char* propNames[] = { "FakeProperties", "FakeProperties-Forced" };
+        for (int forced = 0; forced < 2; forced++)
+        {
+            const Node* p = forced ? forcedProps : props;
+            if (!p)
+                continue;
+            vector<Span> compiled;
+            compileProperties(name, p, forced, xhciMux, record, mux, compiled);
+            // nothing left for the kext to merge: drop the whole dictionary
+            if (p->type == Node::kDict && compiled.size() == p->keys.size())
+                strip.push_back(dict->spans[dict->find(propNames[forced])]);
+            else
+                strip.insert(strip.end(), compiled.begin(), compiled.end());
+        }
+
+        record.ruleFirst = mRules.size();
+        for (int i = 0; i < kMuxRegisterCount; i++)
+        {
+            const MuxRegister& reg = muxRegisters()[i];
+            const MuxSettings& settings = mux[i];
+            if (settings.mixed)
+                error(context, "%s* properties must all be in the same FakeProperties dictionary", reg.prefix);
+            if (!settings.present)
+                continue;
+            uint8_t forced = settings.forced ? kOverrideRuleForced : 0;
+            // only the keys the injector has are carried, so e.g. RM,usb3prm-block
+            // alone does not make the kext manage USB3_PSSEN
+            if (settings.rulePresent)
+            {
+                OverrideBlobWriteRule rule = { reg.offset, 0, settings.rulePresent, settings.mask, settings.force };
+                rule.flags = forced | (settings.block ? kOverrideRuleBlock : 0) | (settings.init ? kOverrideRuleInit : 0) |
+                             (settings.honor ? kOverrideRuleHonorMask : 0);
+                mRules.push_back(rule);
+            }
+            if (settings.maskBlockPresent)
+            {
+                OverrideBlobWriteRule maskRule = { reg.maskOffset, (uint8_t)(forced | (settings.maskBlock ? kOverrideRuleBlock : 0)),
+                                                   kOverrideRulePresentBlock, 0, 0 };
+                mRules.push_back(maskRule);
+            }
+        }
+        record.ruleCount = mRules.size() - record.ruleFirst;
+
+        record.idRefFirst = mIDRefs.size();
+        record.idRefCount = refs.size();
+        mIDRefs.insert(mIDRefs.end(), refs.begin(), refs.end());
+
+        Personality personality = { name, dict, (uint16_t)mRecords.size(), strip };
+        mPersonalities.push_back(personality);
+        mRecords.push_back(record);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+static string base64Encode(const string& in)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string out;
+    for (size_t i = 0; i < in.size(); i += 3)
+    {
+        uint32_t bits = (uint8_t)in[i] << 16;
+        if (i + 1 < in.size()) bits |= (uint8_t)in[i + 1] << 8;
+        if (i + 2 < in.size()) bits |= (uint8_t)in[i + 2];
+        out += table[bits >> 18 & 63];
+        out += table[bits >> 12 & 63];
+        out += i + 1 < in.size() ? table[bits >> 6 & 63] : '=';
+        out += i + 2 < in.size() ? table[bits & 63] : '=';
+    }
+    return out;
+}
+
+// widen span to whole lines when nothing else is on them, so removing it
+// leaves no blank line behind
+static Span lineSpan(const string& source, Span span)
+{
+    size_t first = span.first, second = span.second;
+    while (first > 0 && (source[first - 1] == ' ' || source[first - 1] == '\t'))
+        first--;
+    while (second < source.size() && (source[second] == ' ' || source[second] == '\t' || source[second] == '\r'))
+        second++;
+    if ((first == 0 || source[first - 1] == '\n') && second < source.size() && source[second] == '\n')
+        return Span(first, second + 1);
+    return span;
+}
+
+// insert FakeOverrides/FakeOverridesRecord before each personality's </dict>,
+// and remove the FakeProperties entries compiled into it, keeping the rest of
+// the source untouched
+static string emitPlist(const string& source, const Compiler& compiler, const string& blob)
+{
+    string encoded = base64Encode(blob);
+    // edits as (span to replace, text), applied from the end so earlier offsets stay valid
+    vector<std::pair<Span, string> > edits;
+    for (size_t i = 0; i < compiler.mPersonalities.size(); i++)
+    {
+        const Compiler::Personality& p = compiler.mPersonalities[i];
+        for (size_t j = 0; j < p.strip.size(); j++)
+            edits.push_back(std::make_pair(lineSpan(source, p.strip[j]), string()));
+
+        size_t close = p.dict->closeOffset;
+        size_t lineStart = source.rfind('\n', close - 1) + 1;
+        string indent = source.substr(lineStart, close - lineStart);
+        if (indent.find_first_not_of(" \t") != string::npos)
+            indent = "";
+        string inner = indent + "\t";
+        char record[16];
+        snprintf(record, sizeof(record), "%u", p.record);
+        string text = inner + "<key>FakeOverrides</key>\n" + inner + "<data>" + encoded + "</data>\n" +
+                      inner + "<key>FakeOverridesRecord</key>\n" + inner + "<integer>" + record + "</integer>\n";
+        edits.push_back(std::make_pair(Span(lineStart, lineStart), text));
+    }
+    std::sort(edits.begin(), edits.end());
+    string out = source;
+    for (size_t i = edits.size(); i-- > 0; )
+        out.replace(edits[i].first.first, edits[i].first.second - edits[i].first.first, edits[i].second);
+    return out;
+}
+
+static bool readFile(const char* path, string& contents)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+        contents.append(buf, n);
+    fclose(file);
+    return true;
+}
+
+static bool writeFile(const char* path, const string& contents)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+    return fclose(file) == 0 && ok;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: injector_compiler [-c] [-o output.plist] [-b output.bin] injector.plist\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    const char* plistOut = NULL;
+    const char* blobOut = NULL;
+    const char* input = NULL;
+    bool checkOnly = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-c"))
+            checkOnly = true;
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            plistOut = argv[++i];
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            blobOut = argv[++i];
+        else if (argv[i][0] == '-' || input)
+            usage();
+        else
+            input = argv[i];
+    }
+    if (!input || (!checkOnly && !plistOut && !blobOut))
+        usage();
+    gFileName = input;
+
+    string source;
+    if (!readFile(input, source))
+    {
+        error("", "unable to read file");
+        return 1;
+    }
+
+    PlistReader reader(source);
+    Node* root = reader.parse();
+    if (!root)
+        return 1;
+
+    Compiler compiler;
+    bool ok = compiler.compile(root);
+    if (ok && compiler.mPersonalities.empty())
+    {
+        error("", "no FakePCIID personalities");
+        ok = false;
+    }
+    if (ok && !checkOnly)
+    {
+        string blob = compiler.blob();
+        if (blobOut && !writeFile(blobOut, blob))
+        {
+            error("", "unable to write %s", blobOut);
+            ok = false;
+        }
+        if (plistOut && !writeFile(plistOut, emitPlist(source, compiler, blob)))
+        {
+            error("", "unable to write %s", plistOut);
+            ok = false;
+        }
+    }
+
+    delete root;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// overlay_test: host test of overlayConfigRead (FakePCIID/ConfigRead.h), the
+// byte merge the stub applies to every overridden config read.
+//
+// Every offset (0x00-0xFF) and width (1, 2, 4) is checked, for a set of
+// override masks (none, all, each single byte, the RM,* ID fields, and
+// random masks), against a byte-by-byte model: the config space as the
+// platform returns it (naturally aligned reads) with the overridden header
+// bytes replaced.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../FakePCIID/ConfigRead.h"
+
+static uint8_t gReal[256];
+static uint8_t gFake[64];
+static unsigned long gChecks;
+static int gFailures;
+
+template <typename T>
+static void checkRead(uint8_t offset, uint64_t mask)
+{
+    uint8_t aligned = configReadAlign(offset, sizeof(T));
+    T real = 0, expected = 0;
+    for (unsigned i = 0; i < sizeof(T); i++)
+    {
+        unsigned n = aligned + i;
+        uint8_t fake = n < 64 && (mask >> n & 1) ? gFake[n] : gReal[n];
+        real |= (T)gReal[n] << (8 * i);
+        expected |= (T)fake << (8 * i);
+    }
+
+    T result = overlayConfigRead<T>(real, offset, gFake, mask);
+    gChecks++;
+    if (result != expected && gFailures++ < 20)
+        printf("FAIL: offset 0x%02x width %u mask 0x%016llx: 0x%x, expected 0x%x\n",
+               offset, (unsigned)sizeof(T), (unsigned long long)mask, (unsigned)result, (unsigned)expected);
+}
+
+static void checkMask(uint64_t mask)
+{
+    for (unsigned offset = 0; offset < 256; offset++)
+    {
+        checkRead<uint8_t>(offset, mask);
+        checkRead<uint16_t>(offset, mask);
+        checkRead<uint32_t>(offset, mask);
+    }
+}
+
+int main()
+{
+    srand(1);
+    for (unsigned i = 0; i < sizeof(gReal); i++)
+        gReal[i] = rand();
+    for (unsigned i = 0; i < sizeof(gFake); i++)
+        gFake[i] = ~gReal[i];   // every overridden byte differs from the real one
+
+    checkMask(0);
+    checkMask(~0ULL);
+    for (unsigned n = 0; n < 64; n++)
+        checkMask(1ULL << n);
+    // as loadOverrides: vendor/device ID, revision ID, subsystem vendor/ID
+    checkMask(0xFULL);
+    checkMask(0xFULL | 1ULL << 0x08 | 0xFULL << 0x2C);
+    for (int i = 0; i < 1000; i++)
+        checkMask((uint64_t)rand() << 62 ^ (uint64_t)rand() << 31 ^ (uint64_t)rand());
+
+    if (gFailures)
+    {
+        printf("%d of %lu checks failed\n", gFailures, gChecks);
+        return 1;
+    }
+    printf("overlayConfigRead: %lu checks OK\n", gChecks);
+    return 0;
+}
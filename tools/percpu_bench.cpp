@@ -0,0 +1,149 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// percpu_bench: host benchmark of PerCPU<> (FakePCIID/PerCPU.h) against a
+// single shared set of counters, updated the way profileEnd() updates the
+// RM,Profile counters: one OSIncrementAtomic and one OSAddAtomic64 per
+// config access.
+//
+// For 1..N threads, each thread does the same number of updates; the
+// aggregate rate shows how each layout scales as more cores access config
+// space at once.  The totals are checked against the expected count.
+//
+// usage: percpu_bench [threads [updates-per-thread]]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../FakePCIID/PerCPU.h"
+
+enum { kClients = 16 };
+
+struct Counters
+{
+    volatile UInt32 reads[kClients];
+    volatile SInt64 time[kClients];
+};
+
+static Counters* gShared;
+static PerCPU<Counters> gPerCPU;
+static unsigned long gUpdates;
+static volatile int gStart;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* sharedThread(void* arg)
+{
+    unsigned client = (unsigned)(size_t)arg % kClients;
+    while (!gStart)
+        ;
+    for (unsigned long i = 0; i < gUpdates; i++)
+    {
+        OSIncrementAtomic(&gShared->reads[client]);
+        OSAddAtomic64(1, &gShared->time[client]);
+    }
+    return NULL;
+}
+
+static void* perCPUThread(void* arg)
+{
+    unsigned client = (unsigned)(size_t)arg % kClients;
+    while (!gStart)
+        ;
+    for (unsigned long i = 0; i < gUpdates; i++)
+    {
+        Counters& counters = gPerCPU.local();
+        OSIncrementAtomic(&counters.reads[client]);
+        OSAddAtomic64(1, &counters.time[client]);
+    }
+    return NULL;
+}
+
+// runs threads, returns aggregate updates per microsecond
+static double run(void* (*body)(void*), int threads)
+{
+    pthread_t ids[kPerCPUMaxCPUs];
+    gStart = 0;
+    for (int i = 0; i < threads; i++)
+        pthread_create(&ids[i], NULL, body, (void*)(size_t)i);
+    double start = now();
+    gStart = 1;
+    for (int i = 0; i < threads; i++)
+        pthread_join(ids[i], NULL);
+    return threads * (double)gUpdates / ((now() - start) * 1e6);
+}
+
+static unsigned long long total(bool perCPU)
+{
+    unsigned long long sum = 0;
+    for (int cpu = 0; cpu < (perCPU ? kPerCPUMaxCPUs : 1); cpu++)
+    {
+        const Counters& counters = perCPU ? gPerCPU[cpu] : *gShared;
+        for (int i = 0; i < kClients; i++)
+            sum += counters.reads[i];
+    }
+    return sum;
+}
+
+int main(int argc, char** argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxThreads = argc > 1 ? atoi(argv[1]) : (int)(cpus < 8 ? cpus : 8);
+    gUpdates = argc > 2 ? strtoul(argv[2], NULL, 0) : 2000000;
+    if (maxThreads < 1 || maxThreads > kPerCPUMaxCPUs || !gUpdates)
+    {
+        fprintf(stderr, "usage: percpu_bench [threads (1-%d) [updates-per-thread]]\n", kPerCPUMaxCPUs);
+        return 2;
+    }
+
+    gShared = (Counters*)IOMallocAligned(sizeof(Counters), kPerCPUCacheLine);
+    if (!gShared || !gPerCPU.init())
+        return 1;
+
+    printf("%ld CPUs online, %lu updates per thread, rates in updates/us\n", cpus, gUpdates);
+    printf("threads    shared    PerCPU   speedup\n");
+    int failed = 0;
+    for (int threads = 1; threads <= maxThreads; threads = threads < maxThreads && threads * 2 > maxThreads ? maxThreads : threads * 2)
+    {
+        bzero(gShared, sizeof(Counters));
+        gPerCPU.free();
+        gPerCPU.init();
+        double shared = run(sharedThread, threads);
+        double perCPU = run(perCPUThread, threads);
+        printf("%7d %9.1f %9.1f %8.2fx\n", threads, shared, perCPU, perCPU / shared);
+
+        unsigned long long expected = (unsigned long long)threads * gUpdates;
+        if (total(false) != expected || total(true) != expected)
+        {
+            printf("lost updates: expected %llu, shared %llu, PerCPU %llu\n", expected, total(false), total(true));
+            failed = 1;
+        }
+    }
+
+    gPerCPU.free();
+    IOFreeAligned(gShared, sizeof(Counters));
+    return failed;
+}
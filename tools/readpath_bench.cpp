@@ -0,0 +1,437 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// readpath_bench: host benchmark of a hooked config read, as
+// PCIDeviceStub::configReadCore does it, against N simulated devices.
+//
+// Each read goes through the same steps, in the same order, as the stub:
+// InFlight entry (per-CPU count, epoch re-check), the hook and override
+// lookups in the open addressed override table, the 1-in-N profile tick, the
+// FakeClients check against a sorted kext range table, the config read
+// itself, the override merge (overlayConfigRead from FakePCIID/ConfigRead.h),
+// a profile sample every RM,profile-rate reads, and InFlight exit.  Per-CPU
+// data uses PerCPU<> from FakePCIID/PerCPU.h.  The IOKit-bound parts of
+// FakePCIID.h and KextRangeTable.cpp cannot be built on the host, so they
+// are mirrored here; keep them in step.
+//
+// The config read is a plain load from the device's simulated config space:
+// the numbers are the cost FakePCIID adds to a read, not what a read costs
+// through IOPCIFamily.
+//
+// The kext table is pinned either with one reader count shared by all CPUs
+// (as before the per-CPU pins) or per CPU, to show what the shared write
+// costs as threads are added.  For 1, 2, 4, ... 64 threads, each thread
+// reads from device (thread % devices); threads beyond the number of CPUs
+// only add preemption.
+//
+// usage: readpath_bench [devices [threads [reads-per-thread]]]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../FakePCIID/ConfigRead.h"
+#include "../FakePCIID/PerCPU.h"
+
+enum
+{
+    kMaxDevices = 32,           // FakePCIID::kMaxHooks
+    kOverrideSlotBits = 6,
+    kOverrideSlots = 1 << kOverrideSlotBits,
+    kOverrideSlotEmpty = 0,
+    kKexts = 256,               // loaded kexts in the profile table
+    kClientKexts = 4,           // kexts in the FakeClients table (plus IOPCIFamily)
+    kMaxProfileClients = 16,
+    kProfileRate = 100,
+};
+static const UInt32 kFreeSlot = 0xFFFFFFFE;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// InFlight (FakePCIID.h)
+
+struct InFlightCounters
+{
+    volatile UInt32 entered[2];
+    volatile UInt32 exited[2];
+};
+static PerCPU<InFlightCounters> gInFlight;
+static volatile UInt32 gEpoch;
+
+class InFlight
+{
+public:
+    inline InFlight()
+    {
+        for (;;)
+        {
+            UInt32 epoch = gEpoch;
+            mParity = epoch & 1;
+            OSIncrementAtomic(&gInFlight.local().entered[mParity]);
+            if (gEpoch == epoch)
+                break;
+            OSIncrementAtomic(&gInFlight.local().exited[mParity]);
+        }
+    }
+    inline ~InFlight()
+        { OSIncrementAtomic(&gInFlight.local().exited[mParity]); }
+private:
+    UInt32 mParity;
+};
+
+// KextRangeTable
+
+struct Range
+{
+    UInt64 start;
+    UInt64 end;
+    UInt32 loadTag;
+    UInt32 transit;
+};
+
+struct Pins
+{
+    volatile UInt32 readers[2];
+};
+
+class RangeTable
+{
+public:
+    bool init(unsigned count, UInt64 base)
+    {
+        mCount = count;
+        for (unsigned i = 0; i < count; i++)
+        {
+            mRanges[i].start = base + i * 0x10000ULL;
+            mRanges[i].end = mRanges[i].start + 0x8000;
+            mRanges[i].loadTag = 100 + i;
+            mRanges[i].transit = i == 0;    // IOPCIFamily
+        }
+        mShared = (Pins*)IOMallocAligned(sizeof(Pins), kPerCPUCacheLine);
+        if (!mShared)
+            return false;
+        bzero(mShared, sizeof(Pins));
+        return mPins.init();
+    }
+
+    void free()
+    {
+        mPins.free();
+        IOFreeAligned(mShared, sizeof(Pins));
+    }
+
+    // both buffers hold the same ranges here; only the pinning matters
+    inline const Range* findClient(const void* caller, const void* callerCaller, bool shared)
+    {
+        volatile UInt32* pin = shared ? &mShared->readers[0] : &mPins.local().readers[0];
+        OSIncrementAtomic(pin);
+        const Range* range = find(caller);
+        if (range && range->transit && callerCaller)
+            range = find(callerCaller);
+        OSDecrementAtomic(shared ? pin : &mPins.local().readers[0]);
+        return range;
+    }
+
+    inline bool contains(const void* caller, const void* callerCaller, bool shared)
+    {
+        const Range* range = findClient(caller, callerCaller, shared);
+        return range && !range->transit;
+    }
+
+    inline UInt32 lookupClient(const void* caller, const void* callerCaller, bool shared)
+    {
+        const Range* range = findClient(caller, callerCaller, shared);
+        return range ? range->loadTag : 0xFFFFFFFF;
+    }
+
+    UInt64 address(unsigned index) const { return mRanges[index].start + 0x100; }
+
+private:
+    inline const Range* find(const void* address) const
+    {
+        UInt64 addr = (UInt64)address;
+        UInt32 lo = 0, hi = mCount;
+        while (lo < hi)
+        {
+            UInt32 mid = (lo + hi) / 2;
+            if (mRanges[mid].start <= addr)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (!lo)
+            return NULL;
+        const Range* range = &mRanges[lo - 1];
+        return addr < range->end ? range : NULL;
+    }
+
+    Range mRanges[kKexts];
+    UInt32 mCount;
+    Pins* mShared;
+    PerCPU<Pins> mPins;
+};
+
+// FakePCIID state used by configReadCore
+
+struct ProfileCounters
+{
+    UInt32 tick;
+    volatile UInt32 reads[kMaxProfileClients];
+    volatile UInt32 writes[kMaxProfileClients];
+    volatile SInt64 time[kMaxProfileClients];
+};
+
+struct Hook
+{
+    UInt8 bytes[64];
+    UInt64 mask;
+    RangeTable* clients;
+    UInt32 overrideKey;
+    UInt32 profileRate;
+    volatile UInt32 profileTags[kMaxProfileClients];
+    RangeTable* profileClients;
+    PerCPU<ProfileCounters> profileCounters;
+};
+
+struct Device
+{
+    UInt32 space;
+    UInt32 config[64];
+    Hook hook;
+};
+
+struct OverrideSlot
+{
+    volatile UInt32 key;
+    Hook* volatile hook;
+};
+static OverrideSlot gOverrideSlots[kOverrideSlots];
+
+static inline UInt32 overrideKey(UInt32 space)
+    { return (space & 0x00FFFF00) | 1; }
+static inline UInt32 overrideSlot(UInt32 key)
+    { return (key * 0x9E3779B1) >> (32 - kOverrideSlotBits); }
+
+static inline Hook* findHook(UInt32 space)
+{
+    UInt32 key = overrideKey(space);
+    UInt32 slot = overrideSlot(key);
+    for (int probe = 0; probe < kOverrideSlots; probe++, slot = (slot + 1) & (kOverrideSlots - 1))
+    {
+        UInt32 slotKey = gOverrideSlots[slot].key;
+        if (slotKey == key)
+        {
+            Hook* hook = gOverrideSlots[slot].hook;
+            return hook && hook->overrideKey == key ? hook : NULL;
+        }
+        if (slotKey == kOverrideSlotEmpty)
+            break;
+    }
+    return NULL;
+}
+
+static inline UInt64 profileBegin(Hook* hook)
+{
+    if (!hook->profileRate || ++hook->profileCounters.local().tick % hook->profileRate)
+        return 0;
+    return now();
+}
+
+static void profileEnd(Hook* hook, UInt64 start, const void* caller, const void* callerCaller, bool shared)
+{
+    SInt64 elapsed = now() - start;
+    UInt32 loadTag = hook->profileClients->lookupClient(caller, callerCaller, shared);
+    for (int i = 0; i < kMaxProfileClients; i++)
+    {
+        if (hook->profileTags[i] != loadTag)
+        {
+            __sync_bool_compare_and_swap(&hook->profileTags[i], kFreeSlot, loadTag);
+            if (hook->profileTags[i] != loadTag)
+                continue;
+        }
+        ProfileCounters& counters = hook->profileCounters.local();
+        OSIncrementAtomic(&counters.reads[i]);
+        OSAddAtomic64(elapsed, &counters.time[i]);
+        return;
+    }
+}
+
+template <typename T>
+static inline T superConfigRead(const Device* device, UInt8 offset)
+{
+    uint8_t aligned = configReadAlign(offset, sizeof(T));
+    return (T)(device->config[aligned >> 2] >> (8 * (aligned & 3)));
+}
+
+template <typename T>
+__attribute__((noinline)) static T configReadCore(const Device* device, UInt8 offset, const void* caller, const void* callerCaller, bool shared)
+{
+    Hook* hook = findHook(device->space);
+    UInt64 profile = hook ? profileBegin(hook) : 0;
+    Hook* overrides = findHook(device->space);
+    if (overrides && overrides->clients && !overrides->clients->contains(caller, callerCaller, shared))
+        overrides = NULL;
+
+    T result = superConfigRead<T>(device, offset);
+    T newResult = overrides ? overlayConfigRead(result, offset, overrides->bytes, overrides->mask) : result;
+
+    if (profile)
+        profileEnd(hook, profile, caller, callerCaller, shared);
+    return newResult;
+}
+
+// benchmark
+
+static Device* gDevices;
+static unsigned gDeviceCount;
+static RangeTable gProfileTable, gClientTable;
+static unsigned long gReads;
+static volatile int gStart;
+static bool gShared;
+static volatile UInt32 gSink;
+
+static void* readThread(void* arg)
+{
+    unsigned index = (unsigned)(size_t)arg;
+    const Device* device = &gDevices[index % gDeviceCount];
+    // a FakeClients kext calling through IOPCIFamily's configRead32(offset)
+    const void* caller = (const void*)gClientTable.address(0);
+    const void* callerCaller = (const void*)gClientTable.address(1 + index % kClientKexts);
+    UInt32 sum = 0;
+    while (!gStart)
+        ;
+    for (unsigned long i = 0; i < gReads; i++)
+    {
+        InFlight inFlight;
+        UInt8 offset = (i * 4) & 0x3C;
+        switch (i % 3)
+        {
+            case 0: sum += configReadCore<UInt32>(device, offset, caller, callerCaller, gShared); break;
+            case 1: sum += configReadCore<UInt16>(device, offset + 2, caller, callerCaller, gShared); break;
+            case 2: sum += configReadCore<UInt8>(device, offset + 1, caller, callerCaller, gShared); break;
+        }
+    }
+    gSink += sum;
+    return NULL;
+}
+
+// runs threads, returns aggregate reads per microsecond
+static double run(int threads, bool clients, bool shared)
+{
+    for (unsigned d = 0; d < gDeviceCount; d++)
+        gDevices[d].hook.clients = clients ? &gClientTable : NULL;
+    gShared = shared;
+    pthread_t ids[kPerCPUMaxCPUs];
+    gStart = 0;
+    for (int i = 0; i < threads; i++)
+        pthread_create(&ids[i], NULL, readThread, (void*)(size_t)i);
+    uint64_t start = now();
+    gStart = 1;
+    for (int i = 0; i < threads; i++)
+        pthread_join(ids[i], NULL);
+    return threads * (double)gReads * 1000 / (now() - start);
+}
+
+static bool initDevices()
+{
+    gDevices = (Device*)IOMallocAligned(sizeof(Device) * gDeviceCount, kPerCPUCacheLine);
+    if (!gDevices)
+        return false;
+    bzero(gDevices, sizeof(Device) * gDeviceCount);
+    for (unsigned d = 0; d < gDeviceCount; d++)
+    {
+        Device& device = gDevices[d];
+        // functions spread over buses and slots, as IOPCIAddressSpace bits
+        device.space = (d / 8) << 16 | (d % 8) << 11;
+        for (int i = 0; i < 64; i++)
+            device.config[i] = 0x10008086 + d * 0x01010101 + i;
+        Hook& hook = device.hook;
+        hook.bytes[2] = 0x2A;
+        hook.bytes[3] = 0x00;
+        hook.mask = 3ULL << 2;      // device ID
+        hook.profileRate = kProfileRate;
+        hook.profileClients = &gProfileTable;
+        for (int i = 0; i < kMaxProfileClients; i++)
+            hook.profileTags[i] = kFreeSlot;
+        if (!hook.profileCounters.init())
+            return false;
+        hook.overrideKey = overrideKey(device.space);
+        for (UInt32 slot = overrideSlot(hook.overrideKey);; slot = (slot + 1) & (kOverrideSlots - 1))
+        {
+            if (gOverrideSlots[slot].key == kOverrideSlotEmpty)
+            {
+                gOverrideSlots[slot].key = hook.overrideKey;
+                gOverrideSlots[slot].hook = &hook;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    gDeviceCount = argc > 1 ? atoi(argv[1]) : 8;
+    int maxThreads = argc > 2 ? atoi(argv[2]) : kPerCPUMaxCPUs;
+    gReads = argc > 3 ? strtoul(argv[3], NULL, 0) : 200000;
+    if (gDeviceCount < 1 || gDeviceCount > kMaxDevices || maxThreads < 1 || maxThreads > kPerCPUMaxCPUs || !gReads)
+    {
+        fprintf(stderr, "usage: readpath_bench [devices (1-%d) [threads (1-%d) [reads-per-thread]]]\n", kMaxDevices, kPerCPUMaxCPUs);
+        return 2;
+    }
+
+    if (!gInFlight.init() || !gProfileTable.init(kKexts, 0xFFFFFF7F80000000ULL) ||
+        !gClientTable.init(1 + kClientKexts, 0xFFFFFF7F80000000ULL) || !initDevices())
+        return 1;
+
+    printf("%ld CPUs online, %u devices, %lu reads per thread, 1 in %d profiled, rates in reads/us\n",
+           cpus, gDeviceCount, gReads, kProfileRate);
+    printf("threads     plain  FakeClients: shared pin  per-CPU pin   speedup\n");
+    // first touch of the per-CPU slots and profile tags, not timed
+    run(1, true, false);
+    for (int threads = 1; threads <= maxThreads; threads = threads < maxThreads && threads * 2 > maxThreads ? maxThreads : threads * 2)
+    {
+        double plain = run(threads, false, false);
+        double shared = run(threads, true, true);
+        double perCPU = run(threads, true, false);
+        printf("%7d %9.1f %23.1f %12.1f %8.2fx\n", threads, plain, shared, perCPU, perCPU / shared);
+    }
+
+    // every read entered and exited
+    UInt32 entered = 0, exited = 0;
+    for (int cpu = 0; cpu < kPerCPUMaxCPUs; cpu++)
+    {
+        entered += gInFlight[cpu].entered[0];
+        exited += gInFlight[cpu].exited[0];
+    }
+    if (entered != exited)
+    {
+        printf("InFlight counts do not balance: %u entered, %u exited\n", entered, exited);
+        return 1;
+    }
+    return 0;
+}